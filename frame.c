@@ -0,0 +1,208 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "frame.h"
+
+extern unsigned int *mapcounts;
+
+/**
+ * Free blocks of an order. @bitmap[0] has a bit for each block, and the
+ * levels above summarize the words below them.
+ */
+struct free_area {
+	unsigned long *bitmap[FRAME_MAX_LEVELS];
+	unsigned int nr_levels;
+	unsigned long nr_free;
+};
+
+static struct free_area free_areas[FRAME_MAX_ORDER + 1];
+unsigned int nr_frames = 0;
+
+static bool __test_free(struct free_area *area, unsigned int index)
+{
+	return !!(area->bitmap[0][index / BITS_PER_LONG] & (1UL << (index % BITS_PER_LONG)));
+}
+
+/**
+ * Set the bit for @index, and propagate it upward while the words were
+ * empty.
+ */
+static void __set_free(struct free_area *area, unsigned int index)
+{
+	area->nr_free++;
+
+	for (int level = 0; level < area->nr_levels; level++, index /= BITS_PER_LONG) {
+		unsigned long *word = area->bitmap[level] + index / BITS_PER_LONG;
+		bool was_empty = !*word;
+
+		*word |= 1UL << (index % BITS_PER_LONG);
+		if (!was_empty) break;
+	}
+}
+
+/**
+ * Clear the bit for @index, and propagate it upward while the words become
+ * empty.
+ */
+static void __clear_free(struct free_area *area, unsigned int index)
+{
+	area->nr_free--;
+
+	for (int level = 0; level < area->nr_levels; level++, index /= BITS_PER_LONG) {
+		unsigned long *word = area->bitmap[level] + index / BITS_PER_LONG;
+
+		*word &= ~(1UL << (index % BITS_PER_LONG));
+		if (*word) break;
+	}
+}
+
+/**
+ * Return the index of the lowest free block in @area, or -1 if none.
+ */
+static unsigned int __find_free(struct free_area *area)
+{
+	unsigned int index = 0;
+
+	if (!area->nr_free) return -1;
+
+	/* Follow the lowest set bit from the top down to the bottom level */
+	for (int level = area->nr_levels - 1; level >= 0; level--) {
+		unsigned long word = area->bitmap[level][index];
+
+		index = index * BITS_PER_LONG + __builtin_ctzl(word);
+	}
+	return index;
+}
+
+/**
+ * Free the block of @order at @pfn, merging it with its buddies as long as
+ * they are free
+ */
+static void __free_block(unsigned int pfn, unsigned int order)
+{
+	for (; order < FRAME_MAX_ORDER; order++) {
+		unsigned int buddy = pfn ^ (1U << order);
+
+		if (buddy >= nr_frames) break;
+		if (!__test_free(free_areas + order, buddy >> order)) break;
+
+		__clear_free(free_areas + order, buddy >> order);
+		pfn &= buddy;
+	}
+	__set_free(free_areas + order, pfn >> order);
+}
+
+/**
+ * Take the block of @order at @pfn out of the free block of @from, which
+ * contains it. The rest of the free block is freed back in smaller blocks.
+ */
+static void __split_block(unsigned int pfn, unsigned int order,
+		unsigned int base, unsigned int from)
+{
+	__clear_free(free_areas + from, base >> from);
+
+	while (from > order) {
+		unsigned int half;
+
+		from--;
+		half = base + (1U << from);
+
+		/* Keep the half containing @pfn, and free the other */
+		if (pfn >= half) {
+			__set_free(free_areas + from, base >> from);
+			base = half;
+		} else {
+			__set_free(free_areas + from, half >> from);
+		}
+	}
+}
+
+void init_frames(unsigned int nr)
+{
+	nr_frames = nr;
+
+	for (unsigned int order = 0; order <= FRAME_MAX_ORDER; order++) {
+		struct free_area *area = free_areas + order;
+		unsigned int nr_bits = ((nr_frames - 1) >> order) + 1;
+
+		area->nr_levels = 0;
+		area->nr_free = 0;
+		do {
+			unsigned int nr_words = (nr_bits + BITS_PER_LONG - 1) / BITS_PER_LONG;
+
+			free(area->bitmap[area->nr_levels]);
+			area->bitmap[area->nr_levels++] = calloc(nr_words, sizeof(unsigned long));
+			nr_bits = nr_words;
+		} while (nr_bits > 1);
+	}
+
+	for (unsigned int pfn = 0; pfn < nr_frames; pfn++) {
+		if (!mapcounts[pfn]) __free_block(pfn, 0);
+	}
+}
+
+unsigned int alloc_frames(unsigned int order)
+{
+	unsigned int pfn = -1;
+	unsigned int from = 0;
+
+	if (order > FRAME_MAX_ORDER) return -1;
+
+	/* The lowest free block among the orders that can hold 2^@order frames */
+	for (unsigned int o = order; o <= FRAME_MAX_ORDER; o++) {
+		unsigned int index = __find_free(free_areas + o);
+
+		if (index == -1 || (index << o) >= pfn) continue;
+		pfn = index << o;
+		from = o;
+	}
+	if (pfn == -1) return -1;
+
+	__split_block(pfn, order, pfn, from);
+
+	for (unsigned int i = 0; i < (1U << order); i++) {
+		mapcounts[pfn + i] = 1;
+	}
+	return pfn;
+}
+
+void get_frame(unsigned int pfn)
+{
+	if (mapcounts[pfn]++) return;
+
+	/* Find the free block holding @pfn */
+	for (unsigned int order = 0; order <= FRAME_MAX_ORDER; order++) {
+		unsigned int base = pfn & ~((1U << order) - 1);
+
+		if (__test_free(free_areas + order, base >> order)) {
+			__split_block(pfn, 0, base, order);
+			return;
+		}
+	}
+}
+
+void put_frame(unsigned int pfn)
+{
+	if (--mapcounts[pfn] == 0) __free_block(pfn, 0);
+}
+
+unsigned long nr_free_blocks(unsigned int order)
+{
+	return free_areas[order].nr_free;
+}
@@ -0,0 +1,114 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "types.h"
+
+/**
+ * Page frames are managed by a binary buddy allocator on top of
+ * @mapcounts[]. A free block of order k is 2^k contiguous page frames
+ * starting from a PFN aligned to 2^k, and two free buddies of the same order
+ * are merged into a block of the next order.
+ *
+ * The free blocks of each order are tracked in a hierarchical bitmap. Each
+ * bit of the bottom level is set when the block is free, and each bit of an
+ * upper level is set when the corresponding word of the level below has any
+ * bit set. The top level is a single word, so the free block with the
+ * lowest address is found by counting the trailing zeros of one word per
+ * level. An allocation takes the lowest free block among the orders large
+ * enough, which keeps handing out the free page frame with the smallest PFN
+ * for single frames.
+ *
+ * Once init_frames() is done, @mapcounts[] should be changed only through
+ * the functions below to keep the free blocks in sync.
+ */
+
+/* 64^6 frames are far more than we will ever simulate */
+#define FRAME_MAX_LEVELS	6
+
+/* The largest block is 2^FRAME_MAX_ORDER page frames */
+#define FRAME_MAX_ORDER		10
+
+/* The number of page frames managed */
+extern unsigned int nr_frames;
+
+
+/***********************************************************************
+ * init_frames()
+ *
+ * DESCRIPTION
+ *   Build the free blocks for @nr_frames page frames from the current
+ *   @mapcounts[].
+ */
+void init_frames(unsigned int nr_frames);
+
+/***********************************************************************
+ * alloc_frames()
+ *
+ * DESCRIPTION
+ *   Allocate 2^@order contiguous page frames. The map count of each frame
+ *   becomes 1, and each of them is freed with put_frame() individually.
+ *
+ * RETURN VALUE
+ *   Return the PFN of the first page frame, or -1 if there is no free block
+ *   large enough.
+ */
+unsigned int alloc_frames(unsigned int order);
+
+/***********************************************************************
+ * alloc_frame()
+ *
+ * DESCRIPTION
+ *   Allocate the free page frame with the smallest PFN. Its map count
+ *   becomes 1.
+ *
+ * RETURN VALUE
+ *   Return the PFN of the allocated page frame, or -1 if all page frames
+ *   are in use.
+ */
+static inline unsigned int alloc_frame(void)
+{
+	return alloc_frames(0);
+}
+
+/***********************************************************************
+ * get_frame()
+ *
+ * DESCRIPTION
+ *   Add a mapping to the page frame @pfn. A free page frame is taken out of
+ *   its free block.
+ */
+void get_frame(unsigned int pfn);
+
+/***********************************************************************
+ * put_frame()
+ *
+ * DESCRIPTION
+ *   Remove a mapping from the page frame @pfn. The page frame becomes free
+ *   when the last mapping is removed, and is merged with its free buddies.
+ */
+void put_frame(unsigned int pfn);
+
+/***********************************************************************
+ * nr_free_blocks()
+ *
+ * RETURN VALUE
+ *   Return the number of free blocks of @order.
+ */
+unsigned long nr_free_blocks(unsigned int order);
+
+#endif
@@ -0,0 +1,330 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "types.h"
+#include "oracle.h"
+
+/* Next use of a reference that is never used again */
+#define NEVER	LONG_MAX
+
+struct oracle_ref {
+	unsigned int id;	/* Index to @pages */
+	unsigned int type;
+	long next_page;		/* Next page reference to the page */
+	long next_tlb;		/* Next TLB reference to the page */
+};
+
+struct oracle_page {
+	unsigned int pid;
+	unsigned long vpn;
+	long last_page;		/* Last page reference in its lifetime, or -1 */
+	long last_tlb;		/* Last TLB reference in its lifetime, or -1 */
+
+	bool resident;		/* States for replaying */
+	unsigned long stamp;
+};
+
+/* Candidate to evict. Stale if @stamp does not match the page's */
+struct oracle_slot {
+	long prio;
+	unsigned int id;
+	unsigned long stamp;
+};
+
+/* Max-heap of the candidates in a cache set */
+struct oracle_set {
+	struct oracle_slot *heap;
+	unsigned long nr_slots;
+	unsigned long max_slots;
+	unsigned int nr_resident;
+};
+
+enum {
+	ORACLE_OPT,
+	ORACLE_LRU,
+	ORACLE_FIFO,
+};
+static const char * const oracle_policy_names[] = {
+	[ORACLE_OPT] = "opt",
+	[ORACLE_LRU] = "lru",
+	[ORACLE_FIFO] = "fifo",
+};
+
+static struct oracle_ref *refs = NULL;
+static unsigned long nr_refs = 0;
+static unsigned long max_refs = 0;
+
+static struct oracle_page *pages = NULL;
+static unsigned int nr_pages = 0;
+static unsigned int max_pages = 0;
+
+/* Open-addressing index from (pid, vpn) to @pages. Slots hold id + 1 */
+static unsigned int *page_index = NULL;
+static unsigned int page_index_shift = 0;
+
+
+static inline unsigned int __hash(unsigned int pid, unsigned long vpn)
+{
+	unsigned long key = vpn ^ (pid * 0x9e3779b97f4a7c15UL);
+
+	return (key * 0x9e3779b97f4a7c15UL) >> (BITS_PER_LONG - page_index_shift);
+}
+
+static void __grow_index(void)
+{
+	free(page_index);
+	page_index_shift = page_index_shift ? page_index_shift + 1 : 8;
+	page_index = calloc(1U << page_index_shift, sizeof(*page_index));
+
+	for (unsigned int id = 0; id < nr_pages; id++) {
+		unsigned int i = __hash(pages[id].pid, pages[id].vpn);
+
+		while (page_index[i]) i = (i + 1) & ((1U << page_index_shift) - 1);
+		page_index[i] = id + 1;
+	}
+}
+
+static unsigned int __get_page(unsigned int pid, unsigned long vpn)
+{
+	unsigned int mask;
+	unsigned int i;
+
+	/* Keep the load under a half */
+	if (!page_index || nr_pages * 2 >= (1U << page_index_shift)) __grow_index();
+
+	mask = (1U << page_index_shift) - 1;
+	for (i = __hash(pid, vpn); page_index[i]; i = (i + 1) & mask) {
+		struct oracle_page *pg = pages + page_index[i] - 1;
+
+		if (pg->pid == pid && pg->vpn == vpn) return page_index[i] - 1;
+	}
+
+	if (nr_pages == max_pages) {
+		max_pages = max_pages ? max_pages * 2 : 64;
+		pages = realloc(pages, sizeof(*pages) * max_pages);
+	}
+	pages[nr_pages].pid = pid;
+	pages[nr_pages].vpn = vpn;
+	pages[nr_pages].last_page = -1;
+	pages[nr_pages].last_tlb = -1;
+	page_index[i] = nr_pages + 1;
+
+	return nr_pages++;
+}
+
+void oracle_record(unsigned int pid, unsigned long vpn, unsigned int type)
+{
+	if (nr_refs == max_refs) {
+		max_refs = max_refs ? max_refs * 2 : 1024;
+		refs = realloc(refs, sizeof(*refs) * max_refs);
+	}
+	refs[nr_refs].id = __get_page(pid, vpn);
+	refs[nr_refs].type = type;
+	nr_refs++;
+}
+
+
+/**
+ * Link each reference to the next one to the same page in a forward pass.
+ * Return the number of compulsory page misses, the first references in the
+ * lifetimes of the pages, and @nr_tlb_cold for the TLB as well.
+ */
+static unsigned long __index_next_use(unsigned long *nr_tlb_cold)
+{
+	unsigned long nr_cold = 0;
+
+	*nr_tlb_cold = 0;
+
+	for (unsigned long i = 0; i < nr_refs; i++) {
+		struct oracle_ref *r = refs + i;
+		struct oracle_page *pg = pages + r->id;
+
+		r->next_page = NEVER;
+		r->next_tlb = NEVER;
+
+		if (r->type == ORACLE_FREE) {
+			pg->last_page = -1;
+			pg->last_tlb = -1;
+			continue;
+		}
+
+		if (pg->last_page >= 0) {
+			refs[pg->last_page].next_page = i;
+		} else {
+			nr_cold++;
+		}
+		pg->last_page = i;
+
+		if (r->type != ORACLE_ACCESS) continue;
+
+		if (pg->last_tlb >= 0) {
+			refs[pg->last_tlb].next_tlb = i;
+		} else {
+			(*nr_tlb_cold)++;
+		}
+		pg->last_tlb = i;
+	}
+	return nr_cold;
+}
+
+static void __push_slot(struct oracle_set *set, long prio, unsigned int id, unsigned long stamp)
+{
+	unsigned long i = set->nr_slots++;
+
+	if (set->nr_slots > set->max_slots) {
+		set->max_slots = set->max_slots ? set->max_slots * 2 : 64;
+		set->heap = realloc(set->heap, sizeof(*set->heap) * set->max_slots);
+	}
+
+	for (; i > 0 && set->heap[(i - 1) / 2].prio < prio; i = (i - 1) / 2) {
+		set->heap[i] = set->heap[(i - 1) / 2];
+	}
+	set->heap[i] = (struct oracle_slot) { .prio = prio, .id = id, .stamp = stamp };
+}
+
+static struct oracle_slot __pop_slot(struct oracle_set *set)
+{
+	struct oracle_slot top = set->heap[0];
+	struct oracle_slot last = set->heap[--set->nr_slots];
+	unsigned long i = 0;
+
+	for (;;) {
+		unsigned long child = i * 2 + 1;
+
+		if (child >= set->nr_slots) break;
+		if (child + 1 < set->nr_slots &&
+				set->heap[child + 1].prio > set->heap[child].prio) child++;
+		if (set->heap[child].prio <= last.prio) break;
+
+		set->heap[i] = set->heap[child];
+		i = child;
+	}
+	set->heap[i] = last;
+	return top;
+}
+
+/**
+ * Replay the trace with @policy on @nr_sets sets of @nr_ways entries, and
+ * return the number of misses. The TLB sees only the accesses, and the
+ * page frames see the allocations as well.
+ */
+static unsigned long __replay(int policy, bool tlb, unsigned int nr_sets, unsigned int nr_ways)
+{
+	struct oracle_set *sets = calloc(nr_sets, sizeof(*sets));
+	unsigned long nr_misses = 0;
+	unsigned long stamp = 0;
+
+	for (unsigned int id = 0; id < nr_pages; id++) {
+		pages[id].resident = false;
+	}
+
+	for (unsigned long i = 0; i < nr_refs; i++) {
+		struct oracle_ref *r = refs + i;
+		struct oracle_page *pg = pages + r->id;
+		struct oracle_set *set = sets + (pg->vpn & (nr_sets - 1));
+		long prio;
+
+		if (r->type == ORACLE_FREE) {
+			if (pg->resident) {
+				pg->resident = false;
+				set->nr_resident--;
+			}
+			continue;
+		}
+		if (tlb && r->type != ORACLE_ACCESS) continue;
+
+		if (!pg->resident) {
+			nr_misses++;
+			pg->resident = true;
+			set->nr_resident++;
+		} else if (policy == ORACLE_FIFO) {
+			continue;
+		}
+
+		/* The candidate with the highest priority is evicted first */
+		if (policy == ORACLE_OPT) {
+			prio = tlb ? r->next_tlb : r->next_page;
+		} else {
+			prio = -(long)i;
+		}
+		pg->stamp = ++stamp;
+		__push_slot(set, prio, r->id, pg->stamp);
+
+		while (set->nr_resident > nr_ways) {
+			struct oracle_slot victim = __pop_slot(set);
+			struct oracle_page *v = pages + victim.id;
+
+			if (!v->resident || v->stamp != victim.stamp) continue;
+
+			v->resident = false;
+			set->nr_resident--;
+		}
+	}
+
+	for (unsigned int i = 0; i < nr_sets; i++) {
+		free(sets[i].heap);
+	}
+	free(sets);
+
+	return nr_misses;
+}
+
+static void __report(const char *name, bool tlb, unsigned int nr_sets, unsigned int nr_ways,
+		unsigned long nr_lookups, unsigned long nr_cold)
+{
+	unsigned long nr_opt = 0;
+
+	fprintf(stderr, "%s\n", name);
+	fprintf(stderr, "  refs      : %lu\n", nr_lookups);
+	for (int policy = ORACLE_OPT; policy <= ORACLE_FIFO; policy++) {
+		unsigned long nr_misses = __replay(policy, tlb, nr_sets, nr_ways);
+
+		if (policy == ORACLE_OPT) nr_opt = nr_misses;
+
+		fprintf(stderr, "  %-4s      : %lu misses (%.2f%%)", oracle_policy_names[policy],
+				nr_misses, nr_lookups ? nr_misses * 100.0 / nr_lookups : 0.0);
+		if (policy != ORACLE_OPT) {
+			fprintf(stderr, ", %.2fx opt", nr_opt ? (double)nr_misses / nr_opt : 0.0);
+		}
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "  cold      : %lu misses\n", nr_cold);
+}
+
+void oracle_report(unsigned int nr_frames, unsigned int tlb_sets, unsigned int tlb_ways)
+{
+	unsigned long nr_page_refs = 0;
+	unsigned long nr_accesses = 0;
+	unsigned long nr_tlb_cold;
+	unsigned long nr_cold = __index_next_use(&nr_tlb_cold);
+	char name[80];
+
+	for (unsigned long i = 0; i < nr_refs; i++) {
+		if (refs[i].type == ORACLE_FREE) continue;
+
+		nr_page_refs++;
+		if (refs[i].type == ORACLE_ACCESS) nr_accesses++;
+	}
+
+	snprintf(name, sizeof(name), "Page frames (%u)", nr_frames);
+	__report(name, false, 1, nr_frames, nr_page_refs, nr_cold);
+
+	snprintf(name, sizeof(name), "TLB %ux%u", tlb_sets, tlb_ways);
+	__report(name, true, tlb_sets, tlb_ways, nr_accesses, nr_tlb_cold);
+}
@@ -0,0 +1,57 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __ORACLE_H__
+#define __ORACLE_H__
+
+#include "types.h"
+
+/**
+ * Offline miss oracle. The page references of a trace are recorded without
+ * being simulated, and then replayed against the page frames and the TLB
+ * under Belady's optimal replacement (OPT), which evicts the page used
+ * farthest in the future. The next use of each reference is indexed in a
+ * single forward pass over the recorded trace. LRU and FIFO are replayed
+ * the same way to show how far they are from the lower bound.
+ *
+ * Pages are told apart by their pid and VPN. Freeing a page ends its
+ * lifetime, so a later reference to the VPN is to a new page. Pages shared
+ * by fork are counted for each process.
+ */
+
+#define ORACLE_ALLOC	0	/* Page allocated, which brings it into memory */
+#define ORACLE_ACCESS	1	/* Page read or written through the TLB */
+#define ORACLE_FREE	2	/* Page freed */
+
+
+/***********************************************************************
+ * oracle_record()
+ *
+ * DESCRIPTION
+ *   Append the reference of @type to @vpn of @pid to the trace.
+ */
+void oracle_record(unsigned int pid, unsigned long vpn, unsigned int type);
+
+/***********************************************************************
+ * oracle_report()
+ *
+ * DESCRIPTION
+ *   Replay the recorded trace with @nr_frames page frames and a TLB of
+ *   @tlb_sets x @tlb_ways entries, and print out the misses of OPT, LRU,
+ *   and FIFO.
+ */
+void oracle_report(unsigned int nr_frames, unsigned int tlb_sets, unsigned int tlb_ways);
+
+#endif
@@ -20,6 +20,12 @@
 #include "types.h"
 #include "list_head.h"
 #include "vm.h"
+#include "pagetable.h"
+#include "tlb.h"
+#include "pwc.h"
+#include "frame.h"
+#include "swap.h"
+#include "reclaim.h"
 
 /**
  * Ready queue of the system
@@ -37,26 +43,111 @@ extern struct process *current;
 extern struct pagetable *ptbr;
 
 /**
- * TLB of the system.
+ * The number of page directories mapping each page frame. A directory
+ * shared since fork maps its frames once for all the processes sharing it.
+ * Change it through get_frame() and put_frame() to keep the free frame
+ * bitmap in sync.
  */
-extern struct tlb_entry tlb[1UL << (PTES_PER_PAGE_SHIFT * 2)];
+extern unsigned int *mapcounts;
+
+/**
+ * Whether TLB caches superpages. See __update_superpage()
+ */
+extern bool superpages;
+
+
+/**
+ * ASIDs handed out in the current @asid_generation. A process prefers the
+ * ASID derived from its pid and takes the next free one on a collision.
+ * Once all ASIDs are taken, a new generation begins; the whole TLB is
+ * flushed and every process gets a fresh ASID when it is switched in next
+ * time. The init process owns ASID 0 of the very first generation.
+ */
+static unsigned long asid_generation = 0;
+static bool asid_map[NR_ASIDS] = { [0] = true };
+
+static void __new_asid(struct process *p)
+{
+	unsigned int asid = p->pid % NR_ASIDS;
+
+	for (int i = 0; i < NR_ASIDS && asid_map[asid]; i++) {
+		asid = (asid + 1) % NR_ASIDS;
+	}
+
+	if (asid_map[asid]) {
+		/* Run out of ASIDs. Roll over to the next generation */
+		asid_generation++;
+		for (int i = 0; i < NR_ASIDS; i++) {
+			asid_map[i] = false;
+		}
+		flush_tlb();
+		flush_pwc();
+		asid = p->pid % NR_ASIDS;
+	}
+
+	asid_map[asid] = true;
+	p->asid = asid;
+	p->asid_gen = asid_generation;
+}
 
 
 /**
- * The number of mappings for each page frame. Can be used to determine how
- * many processes are using the page frames.
+ * Whether @pte in @pd is write-protected for copy-on-write. PTE_COW is set
+ * for the pages that were writable before being shared on fork. The pages
+ * in a directory shared since fork are write-protected as a whole until
+ * the directory is copied.
  */
-extern unsigned int mapcounts[];
+static inline bool __pte_cow(struct pte_directory *pd, struct pte *pte)
+{
+	if (pd_shared(pd)) return pte_writable(pte) || pte_cow(pte);
+	return pte_cow(pte) && !pte_writable(pte);
+}
 
 
 /**
- * lookup_tlb(@vpn, @pfn)
+ * Whether writes to @pte in @pd can be served from the TLB. MMU sets the
+ * dirty bit on the page walk, so the translations of clean pages are cached
+ * as read-only to make the first write walk the page table again.
+ */
+static inline bool __pte_writable(struct pte_directory *pd, struct pte *pte)
+{
+	return pte_writable(pte) && pte_dirty(pte) && !pd_shared(pd);
+}
+
+
+/**
+ * A page directory maps a superpage when all of its PTEs are valid and map
+ * the contiguous page frames from a frame aligned to NR_PTES_PER_PAGE with
+ * the same permission. Then its translations can be cached in a single TLB
+ * entry. Promote or demote @pd after its PTEs are changed.
+ */
+static void __update_superpage(struct pte_directory *pd)
+{
+	struct pte *first = pd->ptes;
+
+	pd->huge = false;
+	if (!pte_valid(first) || pte_pfn(first) % NR_PTES_PER_PAGE) return;
+
+	for (int i = 1; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = pd->ptes + i;
+
+		if (!pte_valid(pte) || pte_pfn(pte) != pte_pfn(first) + i) return;
+		if ((pte->val ^ first->val) & (PTE_WRITABLE | PTE_COW)) return;
+	}
+	pd->huge = true;
+}
+
+
+/**
+ * lookup_tlb(@vpn, @pfn, @writable)
  *
  * DESCRIPTION
- *   Translate @vpn of the current process through TLB. DO NOT make your own
+ *   Translate @vpn of the current process through TLB. Only the entries
+ *   tagged with the ASID of @current are considered. DO NOT make your own
  *   data structure for TLB, but use the defined @tlb data structure
  *   to translate. If the requested VPN exists in the TLB, return true
- *   with @pfn is set to its PFN. Otherwise, return false.
+ *   with @pfn is set to its PFN and @writable is set to whether the page
+ *   can be written through the cached entry. Otherwise, return false.
  *   The framework calls this function when needed, so do not call
  *   this function manually.
  *
@@ -64,42 +155,399 @@ extern unsigned int mapcounts[];
  *   Return true if the translation is cached in the TLB.
  *   Return false otherwise
  */
-bool lookup_tlb(unsigned int vpn, unsigned int *pfn)
+bool lookup_tlb(unsigned long vpn, unsigned int *pfn, bool *writable)
 {
-	for (int i = 0; i < sizeof(tlb) / sizeof(*tlb); i++) {
-		struct tlb_entry *t = tlb + i;
-
-		if (!t->valid) continue;
-		else
-			if(t->vpn == vpn){
-				*pfn = t->pfn;
-				return true;
-			}
-	}
-	return false;
+	struct tlb_entry *t = probe_tlb(current->asid, vpn);
+
+	if (!t) return false;
+
+	*pfn = t->huge ? t->pfn + vpn % NR_PTES_PER_PAGE : t->pfn;
+	*writable = t->writable;
+	return true;
 }
 
 
 /**
- * insert_tlb(@vpn, @pfn)
+ * insert_tlb(@vpn, @pte)
  *
  * DESCRIPTION
- *   Insert the mapping from @vpn to @pfn into the TLB. The framework will call
+ *   Insert the mapping from @vpn to the page frame of @pte into the TLB,
+ *   along with the write permission and copy-on-write state of @pte. The framework will call
  *   this function when required, so no need to call this function manually.
+ *   The mapping goes to the set of @vpn, and an entry chosen by the TLB
+ *   replacement policy is evicted when the set is full. When @vpn belongs to
+ *   a superpage, the whole superpage is cached instead unless it has clean
+ *   pages to be written.
+ *
+ */
+void insert_tlb(unsigned long vpn, struct pte *pte)
+{
+	struct pte_directory *pd = lookup_pd(ptbr, vpn, NULL);
+
+	if (superpages && pd->huge) {
+		bool dirty = true;
+		bool writable = pte_writable(pte) && !pd_shared(pd);
+
+		for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+			dirty &= pte_dirty(&pd->ptes[i]);
+		}
+
+		/* Clean pages of a writable superpage are cached one by one */
+		if (dirty || !writable) {
+			fill_tlb_huge(current->asid, vpn, pte_pfn(&pd->ptes[0]),
+					writable, __pte_cow(pd, pte));
+			return;
+		}
+	}
+	fill_tlb(current->asid, vpn, pte_pfn(pte), __pte_writable(pd, pte), __pte_cow(pd, pte));
+}
+
+
+/**
+ * prefetch_tlb_pte(@vpn, @pte)
+ *
+ * DESCRIPTION
+ *   Prefetch the mapping from @vpn to the page frame of @pte into the TLB
+ *   like insert_tlb(). The framework calls this function for the PTEs its
+ *   TLB prefetcher picks while walking the page table.
  *
  */
-void insert_tlb(unsigned int vpn, unsigned int pfn)
+void prefetch_tlb_pte(unsigned long vpn, struct pte *pte)
+{
+	struct pte_directory *pd = lookup_pd(ptbr, vpn, NULL);
+
+	prefetch_tlb(current->asid, vpn, pte_pfn(pte), __pte_writable(pd, pte), __pte_cow(pd, pte));
+}
+
+
+/**
+ * Page reclaim. When no page frame is free, a victim page frame picked by
+ * the replacement policy is written out to the swap area, and all PTEs
+ * mapping it are pointed to the swap slot. The PTEs are found through the
+ * reverse mappings of the page frame in @rmaps.
+ *
+ * A page frame swapped in keeps its swap slot in @swap_cache (slot + 1, 0
+ * if none) until it is freed. If none of its PTEs is dirty when it is
+ * evicted again, the copy in the slot is still up to date and the page is
+ * dropped without writing it out.
+ */
+static unsigned int *swap_cache = NULL;
+
+/**
+ * Reverse mapping from a page frame to the PTE for @vpn in @pd mapping it.
+ * A directory shared since fork maps the frame once for all the processes
+ * sharing it, so @owner, the process holding @pd, is meaningful only while
+ * @pd is not shared.
+ */
+struct rmap {
+	struct pte_directory *pd;
+	unsigned long vpn;
+	struct process *owner;
+	struct list_head list;
+};
+
+/* Reverse mappings of each page frame, allocated on the first mapping */
+static struct list_head *rmaps = NULL;
+
+static inline struct pte *__rmap_pte(struct rmap *r)
+{
+	return &r->pd->ptes[r->vpn % NR_PTES_PER_PAGE];
+}
+
+static void __add_rmap(unsigned int pfn, struct pte_directory *pd, unsigned long vpn,
+		struct process *owner)
+{
+	struct rmap *r = malloc(sizeof(*r));
+
+	if (!rmaps) {
+		rmaps = malloc(sizeof(*rmaps) * nr_frames);
+		for (unsigned int i = 0; i < nr_frames; i++) {
+			INIT_LIST_HEAD(rmaps + i);
+		}
+	}
+
+	r->pd = pd;
+	r->vpn = vpn;
+	r->owner = owner;
+	list_add_tail(&r->list, rmaps + pfn);
+}
+
+/**
+ * Find the reverse mapping of @pfn from @pd. A page frame is mapped to a
+ * single VPN, so @pd maps it at most once.
+ */
+static struct rmap *__find_rmap(unsigned int pfn, struct pte_directory *pd)
+{
+	struct rmap *r;
+
+	if (!rmaps) return NULL;
+
+	list_for_each_entry(r, rmaps + pfn, list) {
+		if (r->pd == pd) return r;
+	}
+	return NULL;
+}
+
+/**
+ * Drop the mapping to @pfn from @pd. The last one stops the replacement
+ * policy from tracking the page frame and releases its swap cache.
+ */
+static void __put_page(unsigned int pfn, struct pte_directory *pd)
+{
+	struct rmap *r = __find_rmap(pfn, pd);
+
+	if (r) {
+		list_del(&r->list);
+		free(r);
+	}
+
+	if (mapcounts[pfn] == 1) {
+		reclaim_remove(pfn);
+		if (swap_cache && swap_cache[pfn]) {
+			put_swap(swap_cache[pfn] - 1);
+			swap_cache[pfn] = 0;
+		}
+	}
+	put_frame(pfn);
+}
+
+/**
+ * Drop the cached translation of @vpn of @p whose PTE in @pd is changed.
+ * Any process may have cached it when @pd is shared since fork.
+ */
+static void __invalidate_pte(struct process *p, struct pte_directory *pd, unsigned long vpn)
+{
+	struct process *q;
+
+	if (!pd_shared(pd)) {
+		invalidate_tlb(p->asid, vpn);
+		return;
+	}
+
+	invalidate_tlb(current->asid, vpn);
+	list_for_each_entry(q, &processes, list) {
+		invalidate_tlb(q->asid, vpn);
+	}
+}
+
+/**
+ * The accessed bits are cleared along with the cached translations so that
+ * MMU sets them again on the next access.
+ */
+bool frame_referenced(unsigned int pfn)
+{
+	struct rmap *r;
+	bool referenced = false;
+
+	if (!rmaps) return false;
+
+	list_for_each_entry(r, rmaps + pfn, list) {
+		struct pte *pte = __rmap_pte(r);
+
+		if (!pte_accessed(pte)) continue;
+
+		pte_clear(pte, PTE_ACCESSED);
+		__invalidate_pte(r->owner, r->pd, r->vpn);
+		referenced = true;
+	}
+	return referenced;
+}
+
+bool frame_dirty(unsigned int pfn)
+{
+	struct rmap *r;
+
+	if (!rmaps) return false;
+
+	list_for_each_entry(r, rmaps + pfn, list) {
+		if (pte_dirty(__rmap_pte(r))) return true;
+	}
+	return false;
+}
+
+/**
+ * Swap out the PTEs mapping @pfn to @slot. The page is written out when
+ * @slot is not allocated yet.
+ */
+static bool __swap_out_ptes(unsigned int pfn, unsigned int *slot)
+{
+	struct rmap *r, *n;
+
+	list_for_each_entry_safe(r, n, rmaps + pfn, list) {
+		struct pte_directory *pd = r->pd;
+		unsigned long vpn = r->vpn;
+		struct pte *pte = __rmap_pte(r);
+
+		if (*slot == -1) {
+			*slot = swap_out(vpn);
+			if (*slot == -1) {
+				/* Still mapped. Let the policy consider it again */
+				reclaim_insert(pfn, r->owner->pid, vpn);
+				return false;
+			}
+		} else {
+			get_swap(*slot);
+		}
+
+		__invalidate_pte(r->owner, pd, vpn);
+		__put_page(pfn, pd);
+
+		pte_clear(pte, PTE_VALID | PTE_ACCESSED | PTE_DIRTY);
+		pte_set(pte, PTE_SWAPPED);
+		pte_set_pfn(pte, *slot);
+		pd->huge = false;
+	}
+	return true;
+}
+
+/**
+ * Reclaim a page frame other than @pinned
+ */
+static bool __reclaim_frame(unsigned int pinned)
+{
+	unsigned int pfn;
+	unsigned int slot = -1;
+	bool clean = false;
+
+	if (!swap_enabled()) return false;
+
+	pfn = reclaim_victim(pinned);
+	if (pfn == -1) return false;
+
+	if (swap_cache && swap_cache[pfn]) {
+		if (!frame_dirty(pfn)) {
+			slot = swap_cache[pfn] - 1;
+			clean = true;
+		} else {
+			put_swap(swap_cache[pfn] - 1);
+			swap_cache[pfn] = 0;
+		}
+	}
+
+	if (!__swap_out_ptes(pfn, &slot)) return false;
+
+	reclaim_stat.evictions++;
+	if (clean) reclaim_stat.clean_evictions++;
+	return !mapcounts[pfn];
+}
+
+/**
+ * Whether reclaiming pages can ever free 2^@order contiguous page frames.
+ * Every frame but @pinned can be reclaimed, so there should be an aligned
+ * block within the memory that does not hold @pinned.
+ */
+static bool __block_reclaimable(unsigned int order, unsigned int pinned)
+{
+	unsigned int nr_blocks;
+
+	if (order > FRAME_MAX_ORDER) return false;
+
+	nr_blocks = nr_frames >> order;
+	if (pinned != -1 && (pinned >> order) < nr_blocks) nr_blocks--;
+
+	return nr_blocks > 0;
+}
+
+/**
+ * Allocate 2^@order contiguous page frames, reclaiming pages but @pinned
+ * until there are enough free ones
+ */
+static unsigned int __alloc_frames(unsigned int order, unsigned int pinned)
 {
-	for (int i = 0; i < sizeof(tlb) / sizeof(*tlb); i++) {
-		struct tlb_entry *t = tlb + i;
+	unsigned int pfn;
+
+	/* Do not swap out the whole memory for a block that never fits */
+	if (!__block_reclaimable(order, pinned)) return -1;
+
+	while ((pfn = alloc_frames(order)) == -1) {
+		if (!__reclaim_frame(pinned)) break;
+	}
+	return pfn;
+}
 
-		if (!t->valid){
-			t->valid = true;
-			t->vpn = vpn;
-			t->pfn = pfn;
+
+/**
+ * Add the reverse mappings of the copy of @pd for @vpn, and hand those of
+ * @pd to the process left with it if @pd is not shared anymore.
+ */
+static void __copy_rmaps(struct pte_directory *pd, struct pte_directory *copy, unsigned long vpn)
+{
+	unsigned long base = vpn - vpn % NR_PTES_PER_PAGE;
+	struct process *owner = NULL;
+	struct process *p;
+
+	for (unsigned long i = 0; i < NR_PTES_PER_PAGE; i++) {
+		if (!pte_valid(&copy->ptes[i])) continue;
+		__add_rmap(pte_pfn(&copy->ptes[i]), copy, base + i, current);
+	}
+
+	if (pd_shared(pd)) return;
+
+	list_for_each_entry(p, &processes, list) {
+		if (lookup_pd(&p->pagetable, vpn, NULL) == pd) {
+			owner = p;
 			break;
 		}
 	}
+
+	for (unsigned long i = 0; owner && i < NR_PTES_PER_PAGE; i++) {
+		if (!pte_valid(&pd->ptes[i])) continue;
+		__find_rmap(pte_pfn(&pd->ptes[i]), pd)->owner = owner;
+	}
+}
+
+/**
+ * Give the current process its own copy of @pd for @vpn if @pd is shared
+ * since fork. Each frame and swap slot in the directory is mapped once more
+ * by the copy, so the writable pages become copy-on-write in both.
+ */
+static struct pte_directory *__unshare_pd(struct pte_directory *pd, unsigned long vpn)
+{
+	struct pte_directory *copy;
+
+	if (!pd_shared(pd)) return pd;
+
+	for (unsigned long i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = &pd->ptes[i];
+
+		if (pte_none(pte)) continue;
+
+		/* No one can have cached a writable translation from @pd */
+		if (pte_writable(pte)) {
+			pte_set(pte, PTE_COW);
+			pte_clear(pte, PTE_WRITABLE);
+		}
+
+		if (pte_swapped(pte)) get_swap(pte_pfn(pte));
+		else get_frame(pte_pfn(pte));
+	}
+
+	/* The page-walk cache should not hand out the shared one anymore */
+	invalidate_pwc(current->asid, vpn / NR_PTES_PER_PAGE);
+
+	copy = unshare_pd(ptbr, vpn);
+	__copy_rmaps(pd, copy, vpn);
+	return copy;
+}
+
+
+/**
+ * Map @vpn of the current process to @pfn, populating the page directory
+ * if needed
+ */
+static void __map_page(unsigned long vpn, unsigned int rw, unsigned int pfn)
+{
+	struct pte_directory *pd;
+	struct pte *pte;
+
+	pd = __unshare_pd(populate_pd(ptbr, vpn), vpn);
+	pte = &pd->ptes[vpn % NR_PTES_PER_PAGE];
+
+	set_pte(pte, pfn, PTE_VALID | (rw >= RW_WRITE ? PTE_WRITABLE : 0));
+	__add_rmap(pfn, pd, vpn, current);
+
+	__update_superpage(pd);
+	reclaim_insert(pfn, current->pid, vpn);
 }
 
 
@@ -119,45 +567,65 @@ void insert_tlb(unsigned int vpn, unsigned int pfn)
  *   Return allocated page frame number.
  *   Return -1 if all page frames are allocated.
  */
-unsigned int alloc_page(unsigned int vpn, unsigned int rw)
+unsigned int alloc_page(unsigned long vpn, unsigned int rw)
 {
-	int pd_index = vpn / NR_PTES_PER_PAGE;
-	int pte_index = vpn % NR_PTES_PER_PAGE;
-	
-	struct pagetable *pt = ptbr;
-	struct pte_directory *pd;
-	struct pte *pte;
-	
-	if (!pt){
+	unsigned int pfn;
+
+	if (!ptbr){
 		fprintf(stderr,"Page Table is NULL!\n");
 		return -1;
 	}
-	pd = pt->outer_ptes[pd_index];
-	
-	if (!pd){
-		pt->outer_ptes[pd_index] = (struct pte_directory*)malloc(sizeof(struct pte_directory));
-		pd = pt->outer_ptes[pd_index];
+
+	/* The buddy allocator gives the smallest free pfn */
+	pfn = __alloc_frames(0, -1);
+	if (pfn == -1) return -1;
+
+	__map_page(vpn, rw, pfn);
+
+	return pfn;
+}
+
+
+/**
+ * alloc_pages(@vpn, @nr_pages, @rw)
+ *
+ * DESCRIPTION
+ *   Allocate @nr_pages physically contiguous page frames, and map them to
+ *   @nr_pages consecutive VPNs from @vpn in order. The frames are taken as a
+ *   block of the smallest order holding @nr_pages from the buddy allocator,
+ *   and the frames beyond @nr_pages are freed back right away.
+ *
+ * RETURN
+ *   Return the first allocated page frame number.
+ *   Return -1 if there are not enough contiguous page frames.
+ */
+unsigned int alloc_pages(unsigned long vpn, unsigned int nr_pages, unsigned int rw)
+{
+	unsigned int order = 0;
+	unsigned int pfn;
+
+	if (!ptbr){
+		fprintf(stderr,"Page Table is NULL!\n");
+		return -1;
 	}
 
-	pte = &pd->ptes[pte_index];
+	/* The buddy allocator has no block larger than this */
+	if (nr_pages > (1U << FRAME_MAX_ORDER)) return -1;
 
-	pte->valid = true;
-	pte->private = 0;
-	
-	if(rw >= RW_WRITE){
-		pte->writable = true;
+	while ((1U << order) < nr_pages) order++;
+
+	pfn = __alloc_frames(order, -1);
+	if (pfn == -1) return -1;
+
+	for (unsigned int i = nr_pages; i < (1U << order); i++) {
+		put_frame(pfn + i);
 	}
-	
-	pte->pfn = -1;
-		
-	for(unsigned int i=0;i<NR_PAGEFRAMES;i++)
-		if(!mapcounts[i]){
-			pte->pfn = i;
-			mapcounts[i]++;
-			break;
-		}
-	
-	return pte->pfn;
+
+	for (unsigned int i = 0; i < nr_pages; i++) {
+		__map_page(vpn + i, rw, pfn + i);
+	}
+
+	return pfn;
 }
 
 
@@ -170,50 +638,77 @@ unsigned int alloc_page(unsigned int vpn, unsigned int rw)
  *   Also, consider carefully for the case when a page is shared by two processes,
  *   and one process is to free the page.
  */
-void free_page(unsigned int vpn)
+void free_page(unsigned long vpn)
 {
-	int pd_index = vpn / NR_PTES_PER_PAGE;
-	int pte_index = vpn % NR_PTES_PER_PAGE;
 	bool flag = false;
 	
 	struct pagetable *pt = ptbr;
 	struct pte_directory *pd;
 	struct pte *pte;
 	
-	pd = pt->outer_ptes[pd_index];
+	pd = __unshare_pd(lookup_pd(pt, vpn, NULL), vpn);
 
-	pte = &pd->ptes[pte_index];
+	pte = &pd->ptes[vpn % NR_PTES_PER_PAGE];
 	
-	for (int i = 0; i < sizeof(tlb) / sizeof(*tlb); i++) {
-		struct tlb_entry *t = tlb + i;
-
-		if (!t->valid) continue;
-		else
-			if(t->vpn == vpn){
-				t->valid = false;
-				t->pfn = 0;
-				t->vpn = 0;
-			}
-	}	
+	invalidate_tlb(current->asid, vpn);
 	
-	if(mapcounts[pte->pfn]>0){
-		mapcounts[pte->pfn]--;
-		pte->valid=false;
-		pte->private=0;
-		pte->writable=false;
-		pte->pfn=0;
+	if (pte_swapped(pte)) {
+		put_swap(pte_pfn(pte));
+		set_pte(pte, 0, 0);
+	} else if(mapcounts[pte_pfn(pte)]>0){
+		__put_page(pte_pfn(pte), pd);
+		set_pte(pte, 0, 0);
 	}
+
+	/* The cached superpage is dropped by invalidate_tlb() above */
+	pd->huge = false;
 	
 	for(int i=0;i<NR_PTES_PER_PAGE;i++){
-		if(!pd->ptes[i].valid) continue;
+		if(pte_none(&pd->ptes[i])) continue;
 		else{
 			flag=true;
 			break;
 		}
 	}
 	
-	if(!flag)
-		free(pd);
+	if(!flag){
+		/* The page-walk cache should not hand out the released directory */
+		invalidate_pwc(current->asid, vpn / NR_PTES_PER_PAGE);
+		release_pd(pt, vpn);
+	}
+}
+
+
+/**
+ * Bring the page at @vpn back from the swap area into a new page frame
+ */
+static bool __swap_in_page(unsigned long vpn, struct pte_directory *pd, struct pte *pte, unsigned int rw)
+{
+	unsigned int slot = pte_pfn(pte);
+	unsigned int pfn = __alloc_frames(0, -1);
+
+	if (pfn == -1) return false;
+
+	if (!swap_in(slot, vpn)) {
+		put_frame(pfn);
+		return false;
+	}
+
+	/* Keep the slot to drop the page without writing while it is clean */
+	if (!swap_cache) swap_cache = calloc(nr_frames, sizeof(*swap_cache));
+	swap_cache[pfn] = slot + 1;
+
+	pte_clear(pte, PTE_SWAPPED);
+	pte_set(pte, PTE_VALID);
+	pte_set_pfn(pte, pfn);
+	__add_rmap(pfn, pd, vpn, current);
+
+	/* The new frame is not shared with anyone, so no need to copy on write */
+	if (rw == RW_WRITE && pte_cow(pte)) pte_set(pte, PTE_WRITABLE);
+
+	__update_superpage(pd);
+	reclaim_insert(pfn, current->pid, vpn);
+	return true;
 }
 
 
@@ -233,30 +728,53 @@ void free_page(unsigned int vpn)
  *   @true on successful fault handling
  *   @false otherwise
  */
-bool handle_page_fault(unsigned int vpn, unsigned int rw)
-{	
-	if(rw == RW_WRITE){
-		int pd_index = vpn / NR_PTES_PER_PAGE;
-		int pte_index = vpn % NR_PTES_PER_PAGE;
-		
-		struct pagetable *pt = ptbr;
-		struct pte_directory *pd;
-		struct pte *pte;
-		
-		pd = pt->outer_ptes[pd_index];
+bool handle_page_fault(unsigned long vpn, unsigned int rw)
+{
+	struct pagetable *pt = ptbr;
+	struct pte_directory *pd;
+	struct pte *pte;
 
-		pte = &pd->ptes[pte_index];
-		
-		if(pte->private==1){
-			pte->writable = true;
-			mapcounts[pte->pfn]--;
-			
-			for(unsigned int i=0;i<NR_PAGEFRAMES;i++)
-				if(!mapcounts[i]){
-					pte->pfn = i;
-					mapcounts[i]++;
-					return true;
-				}
+	pd = lookup_pd(pt, vpn, NULL);
+	if (!pd) return false;
+
+	pte = &pd->ptes[vpn % NR_PTES_PER_PAGE];
+
+	/* Copy the directory shared since fork before changing the PTE */
+	if (pte_swapped(pte) || (rw == RW_WRITE && (pte_writable(pte) || pte_cow(pte)))) {
+		pd = __unshare_pd(pd, vpn);
+		pte = &pd->ptes[vpn % NR_PTES_PER_PAGE];
+	}
+
+	if (pte_swapped(pte)) return __swap_in_page(vpn, pd, pte, rw);
+
+	if(rw == RW_WRITE){
+		if(pte_cow(pte)){
+			unsigned int pfn;
+
+			/**
+			 * Reuse the smallest free frame if the page is not shared
+			 * anymore. Otherwise, allocate the copy first while keeping
+			 * the shared frame from being reclaimed.
+			 */
+			if (mapcounts[pte_pfn(pte)] == 1) {
+				__put_page(pte_pfn(pte), pd);
+				pfn = alloc_frame();
+			} else {
+				pfn = __alloc_frames(0, pte_pfn(pte));
+				if (pfn == -1) return false;
+				__put_page(pte_pfn(pte), pd);
+			}
+			reclaim_insert(pfn, current->pid, vpn);
+
+			/* Breaking the sharing splits the superpage */
+			pd->huge = false;
+			pte_set_pfn(pte, pfn);
+			__add_rmap(pfn, pd, vpn, current);
+			/* The faulting write dirties the new copy right away */
+			pte_set(pte, PTE_WRITABLE | PTE_ACCESSED | PTE_DIRTY);
+			/* The write-protected translation may be cached */
+			update_tlb(current->asid, vpn, pfn, true, false);
+			return true;
 		}
 	}
 	return false;
@@ -271,108 +789,98 @@ bool handle_page_fault(unsigned int vpn, unsigned int rw)
  *   The @current process at the moment should be put into the @processes
  *   list, and @current should be replaced to the requested process.
  *   Make sure that the next process is unlinked from the @processes, and
- *   @ptbr is set properly.
+ *   @ptbr is set properly. TLB entries are tagged with ASIDs, so the TLB is
+ *   not flushed on the switch.
  *
  *   If there is no process with @pid in the @processes list, fork a process
  *   from the @current. This implies the forked child process should have
  *   the identical page table entry 'values' to its parent's (i.e., @current)
  *   page table. 
  *   To implement the copy-on-write feature, you should manipulate the writable
- *   bit in PTE and mapcounts for shared pages. You may use pte->private for 
- *   storing some useful information :-)
+ *   bit in PTE and mapcounts for shared pages. PTE_COW marks the pages that
+ *   were writable before being shared.
  */
 void switch_process(unsigned int pid)
 {
-	struct process *a = NULL;
+	struct process *a = NULL, *p;
 	struct pte_directory *pd, *npd;
 	struct pte *pte, *npte;
+	unsigned long base;
 	
-	list_for_each_entry(a, &processes, list){
-		if(a->pid == pid)
+	/* The cursor ends up on the list head when nothing matches */
+	list_for_each_entry(p, &processes, list){
+		if(p->pid == pid){
+			a = p;
 			break;
+		}
 	}
-	
-	if(a->pid != pid) a = NULL;
 		
 	if(!a){
 		struct process *new = (struct process*)malloc(sizeof(struct process));
 		new->pid = pid;
+		__new_asid(new);
 		
-		for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
-			pd = current->pagetable.outer_ptes[i];
+		setup_pagetable(&new->pagetable);
+		
+		for (base = 0; (pd = next_pd(&current->pagetable, &base)); base += NR_PTES_PER_PAGE) {
+			/* Share the directory until either process changes it */
+			if (share_pd(&new->pagetable, base, pd)) continue;
 
-			if (!pd) continue;
-			else {
-				new->pagetable.outer_ptes[i] = (struct pte_directory*)malloc(sizeof(struct pte_directory));
-				npd = new->pagetable.outer_ptes[i];
+			npd = populate_pd(&new->pagetable, base);
+			npd->huge = pd->huge;
+			
+			for (unsigned long j = 0; j < NR_PTES_PER_PAGE; j++) {
+				pte = &pd->ptes[j];
+				if (pte_none(pte)) continue;
 				
-				for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
-					pte = &pd->ptes[j];
-					if (!pte->valid) continue;
-					
-					npte = &npd->ptes[j];
-					npte->pfn = pte->pfn;
-					npte->private = pte->private;
-					npte->valid = true;
-					if(pte->writable){
-						npte->private = 1;
-						pte->private = 1;
-						pte->writable = false;
-					}
-					
-					mapcounts[pte->pfn]++;
+				npte = &npd->ptes[j];
+				npte->val = pte->val & ~(PTE_WRITABLE | PTE_ACCESSED | PTE_DIRTY);
+				if(pte_writable(pte)){
+					pte_set(npte, PTE_COW);
+					pte_set(pte, PTE_COW);
+					pte_clear(pte, PTE_WRITABLE);
 				}
 				
+				/* Swapped pages share the swap slot */
+				if (pte_swapped(pte)) {
+					get_swap(pte_pfn(pte));
+				} else {
+					get_frame(pte_pfn(pte));
+					__add_rmap(pte_pfn(pte), npd, base + j, new);
+				}
 			}
 		}	
 		
+		/* Downgrade the cached translations of the parent at once */
+		protect_tlb(current->asid);
+
 		list_add(&current->list, &processes);
 		current = new;
 		ptbr = &new->pagetable;
-		for (int i = 0; i < sizeof(tlb) / sizeof(*tlb); i++) {
-			struct tlb_entry *t = tlb + i;
-
-			if (!t->valid) continue;
-			else{
-				t->valid = false;
-				t->pfn = 0;
-				t->vpn = 0;
-			}
-		}
 	}else{
-		for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
-			pd = current->pagetable.outer_ptes[i];
-
-			if (!pd) continue;
-			else {
-				for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
-					pte = &pd->ptes[j];
-					if (!pte->valid) continue;
-					
-					if(pte->writable){
-						pte->private = 1;
-						pte->writable = false;
-					}
-					
-				}
+		for (base = 0; (pd = next_pd(&current->pagetable, &base)); base += NR_PTES_PER_PAGE) {
+			/* Shared directories are write-protected as a whole already */
+			if (pd_shared(pd)) continue;
+
+			for (unsigned long j = 0; j < NR_PTES_PER_PAGE; j++) {
+				pte = &pd->ptes[j];
+				if (pte_none(pte)) continue;
 				
+				if(pte_writable(pte)){
+					pte_set(pte, PTE_COW);
+					pte_clear(pte, PTE_WRITABLE);
+				}
 			}
 		}
+		protect_tlb(current->asid);
+
 		list_add(&current->list, &processes);
 		list_del(&a->list);
 		current = a;
 		ptbr = &a->pagetable;
-		
-		for (int i = 0; i < sizeof(tlb) / sizeof(*tlb); i++) {
-			struct tlb_entry *t = tlb + i;
-
-			if (!t->valid) continue;
-			else{
-				t->valid = false;
-				t->pfn = 0;
-				t->vpn = 0;
-			}
-		}
+
+		/* Entries of other processes stay in TLB, tagged with their ASIDs */
+		if (a->asid_gen != asid_generation) __new_asid(a);
 	}
 }
 
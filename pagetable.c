@@ -0,0 +1,650 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "pagetable.h"
+
+unsigned int pt_levels = NR_PT_LEVELS;
+unsigned int pt_shift = PTES_PER_PAGE_SHIFT;
+
+struct pt_stat pt_stat = { 0 };
+
+/**
+ * Pool of the tables of a size. Tables are carved out of slabs of
+ * PT_SLAB_SIZE bytes, and the freed ones are chained in @free through their
+ * first word to be handed out again. Slabs are never given back.
+ */
+struct pt_pool {
+	unsigned long size;
+	void *free;
+};
+
+/* Upper-level tables and page directories have their own pools */
+static struct pt_pool pt_pools[2];
+
+/**
+ * Organization of the page tables. All page tables of the system take the
+ * one chosen at startup.
+ */
+struct pt_backend {
+	const char *name;
+	bool hashed;
+	struct pte_directory *(*lookup)(struct pagetable *pt, unsigned long vpn, unsigned int *nr_refs);
+	struct pte_directory *(*populate)(struct pagetable *pt, unsigned long vpn);
+	void (*release)(struct pagetable *pt, unsigned long vpn);
+	struct pte_directory *(*next)(struct pagetable *pt, unsigned long *vpn);
+	void (*count)(struct pagetable *pt, unsigned long *nr_tables);
+};
+static const struct pt_backend *pt_backend;
+
+/**
+ * With the hashed page tables, each page directory comes right after its
+ * node, which holds the key and the links of the directory.
+ */
+struct pt_node {
+	unsigned long index;		/* vpn / NR_PTES_PER_PAGE */
+	struct hlist_node hnode;	/* Chain in the buckets of the hashed page table */
+	struct list_head list;		/* In @pds of the page table in the index order */
+};
+
+static inline struct pte_directory *__node_pd(struct pt_node *node)
+{
+	return (struct pte_directory *)(node + 1);
+}
+
+static inline struct pt_node *__pd_node(struct pte_directory *pd)
+{
+	return (struct pt_node *)pd - 1;
+}
+
+static inline unsigned long __pt_index(unsigned long vpn, unsigned int level)
+{
+	return (vpn >> ((pt_levels - 1 - level) * pt_shift)) & (NR_PTES_PER_PAGE - 1);
+}
+
+static bool __table_empty(void **table)
+{
+	for (unsigned long i = 0; i < NR_PTES_PER_PAGE; i++) {
+		if (table[i]) return false;
+	}
+	return true;
+}
+
+bool init_pagetable(unsigned int levels, unsigned int shift)
+{
+	if (levels < 2 || levels > MAX_PT_LEVELS) return false;
+	if (!shift || levels * shift > VPN_MAX_BITS) return false;
+
+	pt_levels = levels;
+	pt_shift = shift;
+	return true;
+}
+
+unsigned long pt_table_size(unsigned int level)
+{
+	if (level == pt_levels - 1) {
+		return (pt_backend->hashed ? sizeof(struct pt_node) : 0) +
+			sizeof(struct pte_directory) + sizeof(struct pte) * NR_PTES_PER_PAGE;
+	}
+	return sizeof(void *) * NR_PTES_PER_PAGE;
+}
+
+static inline struct pt_pool *__pt_pool(unsigned int level)
+{
+	struct pt_pool *pool = pt_pools + (level == pt_levels - 1);
+
+	/* The geometry is fixed before the first table is allocated */
+	if (!pool->size) pool->size = pt_table_size(level);
+	return pool;
+}
+
+/**
+ * Add a slab of tables to the free list of @pool
+ */
+static void __grow_pool(struct pt_pool *pool)
+{
+	unsigned long nr = PT_SLAB_SIZE / pool->size;
+	char *slab;
+
+	if (!nr) nr = 1;
+	slab = malloc(nr * pool->size);
+
+	for (unsigned long i = 0; i < nr; i++) {
+		void **table = (void **)(slab + i * pool->size);
+
+		*table = pool->free;
+		pool->free = table;
+	}
+
+	pt_stat.slabs++;
+	pt_stat.slab_bytes += nr * pool->size;
+	pt_stat.free += nr;
+}
+
+/**
+ * Allocate a zeroed table for @level from its pool
+ */
+static void *__alloc_table(unsigned int level)
+{
+	struct pt_pool *pool = __pt_pool(level);
+	void **table;
+
+	if (!pool->free) __grow_pool(pool);
+
+	table = pool->free;
+	pool->free = *table;
+	memset(table, 0, pool->size);
+
+	pt_stat.free--;
+	pt_stat.tables++;
+	pt_stat.bytes += pool->size;
+	pt_stat.allocs++;
+	return table;
+}
+
+static void __free_table(unsigned int level, void *table)
+{
+	struct pt_pool *pool = __pt_pool(level);
+
+	*(void **)table = pool->free;
+	pool->free = table;
+
+	pt_stat.free++;
+	pt_stat.tables--;
+	pt_stat.bytes -= pool->size;
+}
+
+static struct pte_directory *__radix_lookup(struct pagetable *pt, unsigned long vpn, unsigned int *nr_refs)
+{
+	void **table = pt->outer_ptes;
+	unsigned int level;
+
+	for (level = 0; table && level < pt_levels - 1; level++) {
+		table = table[__pt_index(vpn, level)];
+	}
+	if (nr_refs) *nr_refs = level;
+
+	return (struct pte_directory *)table;
+}
+
+/**
+ * Walk down @pt to the entry of the upper-level table pointing to the page
+ * directory for @vpn, allocating the missing tables on the way
+ */
+static void **__radix_entry(struct pagetable *pt, unsigned long vpn)
+{
+	void **table;
+	void **entry;
+
+	if (!pt->outer_ptes) pt->outer_ptes = __alloc_table(0);
+	table = pt->outer_ptes;
+
+	for (unsigned int level = 0; level < pt_levels - 2; level++) {
+		entry = table + __pt_index(vpn, level);
+		if (!*entry) *entry = __alloc_table(level + 1);
+		table = *entry;
+	}
+
+	return table + __pt_index(vpn, pt_levels - 2);
+}
+
+static struct pte_directory *__radix_populate(struct pagetable *pt, unsigned long vpn)
+{
+	void **entry = __radix_entry(pt, vpn);
+
+	if (!*entry) {
+		struct pte_directory *pd = __alloc_table(pt_levels - 1);
+
+		pd->refcount = 1;
+		*entry = pd;
+	}
+	return *entry;
+}
+
+static void __radix_release(struct pagetable *pt, unsigned long vpn)
+{
+	void **path[MAX_PT_LEVELS];
+	void **table = pt->outer_ptes;
+	struct pte_directory *pd;
+
+	for (unsigned int level = 0; level < pt_levels - 1; level++) {
+		path[level] = table;
+		table = table[__pt_index(vpn, level)];
+	}
+
+	/* Other page tables sharing the directory still hold it */
+	pd = (struct pte_directory *)table;
+	if (--pd->refcount) {
+		pt_stat.shared--;
+	} else {
+		__free_table(pt_levels - 1, pd);
+	}
+
+	/* Unlink the tables from the bottom up while they become empty */
+	for (int level = pt_levels - 2; level >= 0; level--) {
+		path[level][__pt_index(vpn, level)] = NULL;
+		if (level == 0 || !__table_empty(path[level])) break;
+		__free_table(level, path[level]);
+	}
+}
+
+/**
+ * Find the first page directory at or after @vpn under @table of @level,
+ * which maps the VPNs from @base
+ */
+static struct pte_directory *__next_pd(void **table, unsigned int level,
+		unsigned long base, unsigned long *vpn)
+{
+	unsigned int shift = (pt_levels - 1 - level) * pt_shift;
+	unsigned long i = *vpn > base ? (*vpn - base) >> shift : 0;
+
+	for (; i < NR_PTES_PER_PAGE; i++) {
+		unsigned long start = base + (i << shift);
+		struct pte_directory *pd;
+
+		if (!table[i]) continue;
+
+		if (level == pt_levels - 2) {
+			*vpn = start;
+			return table[i];
+		}
+
+		pd = __next_pd(table[i], level + 1, start, vpn);
+		if (pd) return pd;
+	}
+	return NULL;
+}
+
+static struct pte_directory *__radix_next(struct pagetable *pt, unsigned long *vpn)
+{
+	if (!pt->outer_ptes || *vpn >= NR_VPNS) return NULL;
+
+	return __next_pd(pt->outer_ptes, 0, 0, vpn);
+}
+
+static void __count_tables(void **table, unsigned int level, unsigned long *nr_tables)
+{
+	nr_tables[level]++;
+	if (level == pt_levels - 1) return;
+
+	for (unsigned long i = 0; i < NR_PTES_PER_PAGE; i++) {
+		if (table[i]) __count_tables(table[i], level + 1, nr_tables);
+	}
+}
+
+static void __radix_count(struct pagetable *pt, unsigned long *nr_tables)
+{
+	if (pt->outer_ptes) __count_tables(pt->outer_ptes, 0, nr_tables);
+}
+
+
+/**
+ * Hashed page tables. The page directories are looked up by their index,
+ * vpn / NR_PTES_PER_PAGE, instead of walking down the upper levels, so a
+ * sparse address space does not populate any upper-level table. Each page
+ * table also chains its directories in @pds in the index order to visit them
+ * in the VPN order.
+ *
+ * The per-process hashed page table chains the directories in buckets of
+ * the process, which are doubled when the directories outnumber them. The
+ * inverted page table is a single open-addressing table of the system keyed
+ * by the address space and the index, which is kept under a half full.
+ * Address spaces are told apart by the ids of their page tables rather than
+ * the pids, as switching to the pid of @current forks another process of
+ * the same pid.
+ *
+ * A lookup reads the bucket and the nodes chained in front of the directory,
+ * or the slots probed in the inverted page table.
+ */
+#define PT_HASH_SHIFT	4
+#define IPT_SHIFT	8
+
+struct ipt_slot {
+	unsigned int id;
+	unsigned long index;
+	struct pte_directory *pd;	/* NULL if the slot is empty */
+};
+
+static struct ipt_slot *ipt = NULL;
+static unsigned int ipt_shift = 0;
+static unsigned long ipt_used = 0;
+
+static inline unsigned long __pt_hash(unsigned int id, unsigned long index, unsigned int shift)
+{
+	unsigned long key = index ^ (id * 0x9e3779b97f4a7c15UL);
+
+	return (key * 0x9e3779b97f4a7c15UL) >> (BITS_PER_LONG - shift);
+}
+
+static struct pte_directory *__alloc_node(struct pagetable *pt, unsigned long index)
+{
+	struct pt_node *node = __alloc_table(pt_levels - 1);
+	struct pt_node *prev;
+
+	node->index = index;
+	__node_pd(node)->refcount = 1;
+
+	/* Directories are mostly added in the index order, so look from the tail */
+	list_for_each_entry_reverse(prev, &pt->pds, list) {
+		if (prev->index < index) break;
+	}
+	list_add(&node->list, &prev->list);
+	pt->nr_pds++;
+
+	return __node_pd(node);
+}
+
+static void __free_node(struct pagetable *pt, struct pt_node *node)
+{
+	list_del(&node->list);
+	pt->nr_pds--;
+	__free_table(pt_levels - 1, node);
+}
+
+static struct pte_directory *__hash_lookup(struct pagetable *pt, unsigned long vpn, unsigned int *nr_refs)
+{
+	unsigned long index = vpn / NR_PTES_PER_PAGE;
+	unsigned int refs = 0;
+	struct pt_node *node;
+
+	if (!pt->buckets) {
+		if (nr_refs) *nr_refs = 0;
+		return NULL;
+	}
+
+	refs++;
+	hlist_for_each_entry(node, pt->buckets + __pt_hash(0, index, pt->bucket_shift), hnode) {
+		if (node->index == index) break;
+		refs++;
+	}
+	if (nr_refs) *nr_refs = refs;
+
+	return node ? __node_pd(node) : NULL;
+}
+
+static void __grow_buckets(struct pagetable *pt)
+{
+	struct pt_node *node;
+	unsigned long nr;
+
+	if (pt->buckets) {
+		pt_stat.buckets -= 1UL << pt->bucket_shift;
+		pt_stat.bucket_bytes -= sizeof(*pt->buckets) << pt->bucket_shift;
+		free(pt->buckets);
+	}
+
+	pt->bucket_shift = pt->bucket_shift ? pt->bucket_shift + 1 : PT_HASH_SHIFT;
+	nr = 1UL << pt->bucket_shift;
+	pt->buckets = calloc(nr, sizeof(*pt->buckets));
+	pt_stat.buckets += nr;
+	pt_stat.bucket_bytes += sizeof(*pt->buckets) * nr;
+
+	list_for_each_entry(node, &pt->pds, list) {
+		hlist_add_head(&node->hnode, pt->buckets + __pt_hash(0, node->index, pt->bucket_shift));
+	}
+}
+
+static struct pte_directory *__hash_populate(struct pagetable *pt, unsigned long vpn)
+{
+	unsigned long index = vpn / NR_PTES_PER_PAGE;
+	struct pte_directory *pd = __hash_lookup(pt, vpn, NULL);
+	struct pt_node *node;
+
+	if (pd) return pd;
+
+	/* Keep the load factor of the buckets up to 1 */
+	if (!pt->buckets || pt->nr_pds >= (1UL << pt->bucket_shift)) __grow_buckets(pt);
+
+	pd = __alloc_node(pt, index);
+	node = __pd_node(pd);
+	hlist_add_head(&node->hnode, pt->buckets + __pt_hash(0, index, pt->bucket_shift));
+
+	return pd;
+}
+
+static void __hash_release(struct pagetable *pt, unsigned long vpn)
+{
+	struct pt_node *node = __pd_node(__hash_lookup(pt, vpn, NULL));
+
+	hlist_del(&node->hnode);
+	__free_node(pt, node);
+}
+
+static struct pte_directory *__ipt_lookup(struct pagetable *pt, unsigned long vpn, unsigned int *nr_refs)
+{
+	unsigned long index = vpn / NR_PTES_PER_PAGE;
+	unsigned long mask = (1UL << ipt_shift) - 1;
+	unsigned int refs = 0;
+	struct ipt_slot *slot = NULL;
+
+	if (ipt) {
+		for (unsigned long i = __pt_hash(pt->id, index, ipt_shift); ; i = (i + 1) & mask) {
+			refs++;
+			slot = ipt + i;
+			if (!slot->pd || (slot->id == pt->id && slot->index == index)) break;
+		}
+	}
+	if (nr_refs) *nr_refs = refs;
+
+	return slot ? slot->pd : NULL;
+}
+
+static void __ipt_insert(unsigned int id, unsigned long index, struct pte_directory *pd)
+{
+	unsigned long mask = (1UL << ipt_shift) - 1;
+	unsigned long i;
+
+	for (i = __pt_hash(id, index, ipt_shift); ipt[i].pd; i = (i + 1) & mask);
+
+	ipt[i].id = id;
+	ipt[i].index = index;
+	ipt[i].pd = pd;
+}
+
+static void __grow_ipt(void)
+{
+	struct ipt_slot *old = ipt;
+	unsigned long nr = old ? 1UL << ipt_shift : 0;
+
+	ipt_shift = ipt_shift ? ipt_shift + 1 : IPT_SHIFT;
+	ipt = calloc(1UL << ipt_shift, sizeof(*ipt));
+	pt_stat.buckets = 1UL << ipt_shift;
+	pt_stat.bucket_bytes = sizeof(*ipt) << ipt_shift;
+
+	for (unsigned long i = 0; i < nr; i++) {
+		if (old[i].pd) __ipt_insert(old[i].id, old[i].index, old[i].pd);
+	}
+	free(old);
+}
+
+static struct pte_directory *__ipt_populate(struct pagetable *pt, unsigned long vpn)
+{
+	unsigned long index = vpn / NR_PTES_PER_PAGE;
+	struct pte_directory *pd = __ipt_lookup(pt, vpn, NULL);
+
+	if (pd) return pd;
+
+	/* Keep the load under a half */
+	if (!ipt || ipt_used * 2 >= (1UL << ipt_shift)) __grow_ipt();
+
+	pd = __alloc_node(pt, index);
+	__ipt_insert(pt->id, index, pd);
+	ipt_used++;
+
+	return pd;
+}
+
+static void __ipt_release(struct pagetable *pt, unsigned long vpn)
+{
+	unsigned long index = vpn / NR_PTES_PER_PAGE;
+	unsigned long mask = (1UL << ipt_shift) - 1;
+	unsigned long i, j;
+
+	for (i = __pt_hash(pt->id, index, ipt_shift); ; i = (i + 1) & mask) {
+		if (ipt[i].pd && ipt[i].id == pt->id && ipt[i].index == index) break;
+	}
+	__free_node(pt, __pd_node(ipt[i].pd));
+	ipt_used--;
+
+	/**
+	 * Shift the following slots of the cluster back into the hole unless
+	 * their home slot lies cyclically in (i, j], so that no lookup stops
+	 * at the hole before reaching its slot.
+	 */
+	for (j = (i + 1) & mask; ipt[j].pd; j = (j + 1) & mask) {
+		unsigned long home = __pt_hash(ipt[j].id, ipt[j].index, ipt_shift);
+
+		if (((j - home) & mask) < ((j - i) & mask)) continue;
+
+		ipt[i] = ipt[j];
+		i = j;
+	}
+	ipt[i].pd = NULL;
+}
+
+/**
+ * Find the directory at or after @vpn in the index order. Walking through
+ * the directories in the VPN order finds @vpn or the directory right before
+ * it in the hash, so the chain in @pds is searched only on a jump.
+ */
+static struct pte_directory *__hashed_next(struct pagetable *pt, unsigned long *vpn)
+{
+	unsigned long index = *vpn / NR_PTES_PER_PAGE;
+	struct pte_directory *pd;
+	struct pt_node *node;
+
+	if (!pt->nr_pds || *vpn >= NR_VPNS) return NULL;
+
+	if ((pd = pt_backend->lookup(pt, *vpn, NULL))) {
+		node = __pd_node(pd);
+	} else if (index && (pd = pt_backend->lookup(pt, *vpn - NR_PTES_PER_PAGE, NULL))) {
+		node = list_next_entry(__pd_node(pd), list);
+	} else {
+		list_for_each_entry(node, &pt->pds, list) {
+			if (node->index >= index) break;
+		}
+	}
+	if (&node->list == &pt->pds) return NULL;
+
+	*vpn = node->index * NR_PTES_PER_PAGE;
+	return __node_pd(node);
+}
+
+static void __hashed_count(struct pagetable *pt, unsigned long *nr_tables)
+{
+	nr_tables[pt_levels - 1] += pt->nr_pds;
+}
+
+
+static const struct pt_backend pt_backends[] = {
+	{ "radix", false, __radix_lookup, __radix_populate, __radix_release,
+		__radix_next, __radix_count },
+	{ "hash", true, __hash_lookup, __hash_populate, __hash_release,
+		__hashed_next, __hashed_count },
+	{ "inverted", true, __ipt_lookup, __ipt_populate, __ipt_release,
+		__hashed_next, __hashed_count },
+};
+static const struct pt_backend *pt_backend = pt_backends;
+
+bool set_pt_backend(const char *name)
+{
+	for (int i = 0; i < sizeof(pt_backends) / sizeof(*pt_backends); i++) {
+		if (strcmp(pt_backends[i].name, name) == 0) {
+			pt_backend = pt_backends + i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *pt_backend_name(void)
+{
+	return pt_backend->name;
+}
+
+bool pt_hashed(void)
+{
+	return pt_backend->hashed;
+}
+
+void setup_pagetable(struct pagetable *pt)
+{
+	/* 0 is taken by the page table of the initial process */
+	static unsigned int nr_ids = 1;
+
+	memset(pt, 0, sizeof(*pt));
+	pt->id = nr_ids++;
+	INIT_LIST_HEAD(&pt->pds);
+}
+
+struct pte_directory *lookup_pd(struct pagetable *pt, unsigned long vpn, unsigned int *nr_refs)
+{
+	return pt_backend->lookup(pt, vpn, nr_refs);
+}
+
+bool share_pd(struct pagetable *pt, unsigned long vpn, struct pte_directory *pd)
+{
+	void **entry;
+
+	/* The directories of the hashed page tables are linked into one */
+	if (pt_backend->hashed) return false;
+
+	entry = __radix_entry(pt, vpn);
+	*entry = pd;
+	pd->refcount++;
+	pt_stat.shared++;
+	return true;
+}
+
+struct pte_directory *unshare_pd(struct pagetable *pt, unsigned long vpn)
+{
+	void **entry = __radix_entry(pt, vpn);
+	struct pte_directory *pd = *entry;
+	struct pte_directory *copy = __alloc_table(pt_levels - 1);
+
+	memcpy(copy, pd, pt_table_size(pt_levels - 1));
+	copy->refcount = 1;
+	*entry = copy;
+
+	pd->refcount--;
+	pt_stat.shared--;
+	return copy;
+}
+
+struct pte_directory *populate_pd(struct pagetable *pt, unsigned long vpn)
+{
+	return pt_backend->populate(pt, vpn);
+}
+
+void release_pd(struct pagetable *pt, unsigned long vpn)
+{
+	pt_backend->release(pt, vpn);
+}
+
+struct pte_directory *next_pd(struct pagetable *pt, unsigned long *vpn)
+{
+	return pt_backend->next(pt, vpn);
+}
+
+void count_pagetable(struct pagetable *pt, unsigned long *nr_tables)
+{
+	pt_backend->count(pt, nr_tables);
+}
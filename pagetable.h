@@ -0,0 +1,241 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __PAGETABLE_H__
+#define __PAGETABLE_H__
+
+#include "types.h"
+#include "vm.h"
+
+/**
+ * Page table walkers shared by MMU and the OS. A VPN is split into
+ * @pt_levels indices of @pt_shift bits each, from the top level down to the
+ * page directory; the index at level l (0 for the top) is
+ *   (vpn >> ((pt_levels - 1 - l) * pt_shift)) % NR_PTES_PER_PAGE
+ *
+ * Tables are allocated from pools of slabs instead of one by one with
+ * malloc(), and recycled through the free lists of the pools.
+ *
+ * Instead of the radix tree above, the page directories can be looked up by
+ * hashing vpn / NR_PTES_PER_PAGE; in a hashed page table per process, or in
+ * the inverted page table shared by the system and keyed by the address
+ * space as well.
+ * @pt_levels then only tells the width of VPNs. Either way the page tables
+ * are accessed through the functions below.
+ *
+ * The radix page tables of a forked process share the page directories of
+ * the parent until either of them changes a PTE in the directory. A shared
+ * directory is counted in @refcount of the directory, and maps its page
+ * frames and swap slots only once.
+ */
+
+/* Size of a slab of tables in bytes. A table larger than that takes a slab */
+#define PT_SLAB_SIZE	(64 << 10)
+
+/**
+ * Page table memory statistics. @tables and @bytes are the tables in use
+ * and their size, and @free counts the tables in the free lists. @slabs
+ * take @slab_bytes in total. @allocs counts the tables handed out so far.
+ * @buckets are the hash buckets or the slots of the inverted page table,
+ * which take @bucket_bytes. @shared counts the references to the page
+ * directories beyond the first, each of which saved copying a directory.
+ */
+struct pt_stat {
+	unsigned long tables;
+	unsigned long bytes;
+	unsigned long free;
+	unsigned long slabs;
+	unsigned long slab_bytes;
+	unsigned long allocs;
+	unsigned long buckets;
+	unsigned long bucket_bytes;
+	unsigned long shared;
+};
+extern struct pt_stat pt_stat;
+
+
+/***********************************************************************
+ * init_pagetable()
+ *
+ * DESCRIPTION
+ *   Set the geometry of the page tables to @levels levels of 2^@shift
+ *   entries. Should be called before any page table is populated.
+ *
+ * RETURN VALUE
+ *   Return true on success, false if the geometry is out of the limits.
+ */
+bool init_pagetable(unsigned int levels, unsigned int shift);
+
+/***********************************************************************
+ * set_pt_backend()
+ *
+ * DESCRIPTION
+ *   Choose the organization of the page tables by @name, which is one of
+ *   "radix" (default), "hash", and "inverted". Should be called before any
+ *   page table is populated.
+ *
+ * RETURN VALUE
+ *   Return true on success, false if there is no such organization.
+ */
+bool set_pt_backend(const char *name);
+
+/***********************************************************************
+ * pt_backend_name()
+ *
+ * RETURN VALUE
+ *   Return the name of the organization of the page tables.
+ */
+const char *pt_backend_name(void);
+
+/***********************************************************************
+ * pt_hashed()
+ *
+ * RETURN VALUE
+ *   Return true if the page directories are looked up by hashing.
+ */
+bool pt_hashed(void);
+
+/***********************************************************************
+ * setup_pagetable()
+ *
+ * DESCRIPTION
+ *   Initialize the empty page table @pt of a new address space.
+ */
+void setup_pagetable(struct pagetable *pt);
+
+/***********************************************************************
+ * lookup_pd()
+ *
+ * DESCRIPTION
+ *   Walk down @pt to the page directory holding the PTE of @vpn. The number
+ *   of the entries read on the way, the upper-level tables or the hash
+ *   buckets and entries, is put into @nr_refs unless it is NULL.
+ *
+ * RETURN VALUE
+ *   Return the page directory, or NULL if it is not populated.
+ */
+struct pte_directory *lookup_pd(struct pagetable *pt, unsigned long vpn, unsigned int *nr_refs);
+
+/***********************************************************************
+ * lookup_pte()
+ *
+ * RETURN VALUE
+ *   Return the PTE of @vpn in @pt, or NULL if its page directory is not
+ *   populated.
+ */
+static inline struct pte *lookup_pte(struct pagetable *pt, unsigned long vpn)
+{
+	struct pte_directory *pd = lookup_pd(pt, vpn, NULL);
+
+	return pd ? pd->ptes + vpn % NR_PTES_PER_PAGE : NULL;
+}
+
+/***********************************************************************
+ * populate_pd()
+ *
+ * DESCRIPTION
+ *   Walk down @pt to the page directory for @vpn like lookup_pd(),
+ *   allocating the missing tables on the way from the pools. New tables
+ *   are zeroed. The hashed page tables grow their buckets as needed.
+ *
+ * RETURN VALUE
+ *   Return the page directory.
+ */
+struct pte_directory *populate_pd(struct pagetable *pt, unsigned long vpn);
+
+/***********************************************************************
+ * release_pd()
+ *
+ * DESCRIPTION
+ *   Drop the page directory for @vpn from @pt, and free the upper-level
+ *   tables left empty by that except for the top level back to their pools.
+ *   The directory is freed as well unless other page tables share it.
+ */
+void release_pd(struct pagetable *pt, unsigned long vpn);
+
+/***********************************************************************
+ * share_pd()
+ *
+ * DESCRIPTION
+ *   Put the page directory @pd of another page table into @pt for @vpn,
+ *   populating the upper-level tables on the way, and take a reference to
+ *   it. The PTEs in a shared directory should be changed only after giving
+ *   the page table its own copy with unshare_pd().
+ *
+ * RETURN VALUE
+ *   Return true on success, false if the page tables cannot share their
+ *   directories, which is the case with the hashed page tables.
+ */
+bool share_pd(struct pagetable *pt, unsigned long vpn, struct pte_directory *pd);
+
+/***********************************************************************
+ * unshare_pd()
+ *
+ * DESCRIPTION
+ *   Replace the shared page directory for @vpn in @pt with a copy of it,
+ *   and drop the reference to the shared one.
+ *
+ * RETURN VALUE
+ *   Return the copy.
+ */
+struct pte_directory *unshare_pd(struct pagetable *pt, unsigned long vpn);
+
+/***********************************************************************
+ * pd_shared()
+ *
+ * RETURN VALUE
+ *   Return true if @pd is shared by more than one page table.
+ */
+static inline bool pd_shared(struct pte_directory *pd)
+{
+	return pd->refcount > 1;
+}
+
+/***********************************************************************
+ * next_pd()
+ *
+ * DESCRIPTION
+ *   Find the first populated page directory of @pt that maps @vpn or the
+ *   VPNs after it, and set @vpn to the first VPN the directory maps. All
+ *   page directories are visited in the VPN order with;
+ *
+ *     for (vpn = 0; (pd = next_pd(pt, &vpn)); vpn += NR_PTES_PER_PAGE)
+ *
+ * RETURN VALUE
+ *   Return the page directory, or NULL if there is no more.
+ */
+struct pte_directory *next_pd(struct pagetable *pt, unsigned long *vpn);
+
+/***********************************************************************
+ * count_pagetable()
+ *
+ * DESCRIPTION
+ *   Add the number of tables of each level of @pt to @nr_tables[], which
+ *   has @pt_levels elements. The hashed page tables have the page
+ *   directories only. A shared page directory is counted by each page table
+ *   sharing it.
+ */
+void count_pagetable(struct pagetable *pt, unsigned long *nr_tables);
+
+/***********************************************************************
+ * pt_table_size()
+ *
+ * RETURN VALUE
+ *   Return the size in bytes of a table at @level, including the node of
+ *   a page directory in the hashed page tables.
+ */
+unsigned long pt_table_size(unsigned int level);
+
+#endif
@@ -0,0 +1,105 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "pwc.h"
+
+struct walk_stat walk_stat = { 0 };
+
+unsigned int nr_pwc_entries = 0;
+
+static struct pwc_entry *pwc = NULL;
+static unsigned int pwc_shift = 0;
+
+/**
+ * Hash @asid and @index with the high bits of the product, as the ASID sits
+ * at the top of the key and the low bits never see it.
+ */
+static inline struct pwc_entry *__pwc_slot(unsigned int asid, unsigned long index)
+{
+	unsigned long key = index ^ ((unsigned long)asid << (BITS_PER_LONG - ASID_BITS));
+
+	/* Shifting by BITS_PER_LONG is undefined */
+	if (!pwc_shift) return pwc;
+
+	return pwc + ((key * 0x9e3779b97f4a7c15UL) >> (BITS_PER_LONG - pwc_shift));
+}
+
+bool init_pwc(unsigned int nr_entries)
+{
+	if (nr_entries & (nr_entries - 1)) return false;
+
+	nr_pwc_entries = nr_entries;
+	for (pwc_shift = 0; (1U << pwc_shift) < nr_entries; pwc_shift++);
+	if (nr_entries) {
+		pwc = calloc(nr_entries, sizeof(*pwc));
+	}
+	return true;
+}
+
+struct pte_directory *lookup_pwc(unsigned int asid, unsigned long index)
+{
+	struct pwc_entry *p;
+
+	if (!nr_pwc_entries) return NULL;
+
+	p = __pwc_slot(asid, index);
+	if (!p->valid || p->asid != asid || p->index != index) {
+		walk_stat.misses++;
+		return NULL;
+	}
+
+	walk_stat.hits++;
+	return p->pd;
+}
+
+void fill_pwc(unsigned int asid, unsigned long index, struct pte_directory *pd)
+{
+	struct pwc_entry *p;
+
+	if (!nr_pwc_entries) return;
+
+	p = __pwc_slot(asid, index);
+	p->valid = true;
+	p->asid = asid;
+	p->index = index;
+	p->pd = pd;
+}
+
+void invalidate_pwc(unsigned int asid, unsigned long index)
+{
+	struct pwc_entry *p;
+
+	if (!nr_pwc_entries) return;
+
+	p = __pwc_slot(asid, index);
+	if (p->valid && p->asid == asid && p->index == index) {
+		p->valid = false;
+		p->pd = NULL;
+	}
+}
+
+void flush_pwc(void)
+{
+	for (unsigned int i = 0; i < nr_pwc_entries; i++) {
+		pwc[i].valid = false;
+		pwc[i].pd = NULL;
+	}
+}
@@ -0,0 +1,106 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __PWC_H__
+#define __PWC_H__
+
+#include "types.h"
+#include "vm.h"
+
+/**
+ * Page-walk cache of MMU. It caches the page directories recently found by
+ * page walks, keyed by the VPN bits above the page directory, so that a
+ * walk can skip reading all the upper levels of the page table. Entries
+ * are tagged with the ASID of the address space like TLB entries, and the
+ * cache is direct-mapped.
+ */
+struct pwc_entry {
+	bool valid;
+	unsigned int asid;
+	unsigned long index;		/* vpn / NR_PTES_PER_PAGE */
+	struct pte_directory *pd;
+};
+
+/* The default number of page-walk cache entries */
+#define NR_PWC_ENTRIES	16
+
+/**
+ * Page walk statistics. @refs counts the page table entries read from
+ * memory by page walks, and @hits counts the walks that skipped reading
+ * the upper levels thanks to the page-walk cache. @touched[n] counts the
+ * walks that read n levels of the page table.
+ */
+struct walk_stat {
+	unsigned long walks;
+	unsigned long refs;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long touched[MAX_PT_LEVELS + 1];
+};
+extern struct walk_stat walk_stat;
+
+extern unsigned int nr_pwc_entries;
+
+
+/***********************************************************************
+ * init_pwc()
+ *
+ * DESCRIPTION
+ *   Allocate the page-walk cache with @nr_entries entries, which should be
+ *   a power of two. 0 disables the page-walk cache.
+ *
+ * RETURN VALUE
+ *   Return true on success, false if @nr_entries is not valid.
+ */
+bool init_pwc(unsigned int nr_entries);
+
+/***********************************************************************
+ * lookup_pwc()
+ *
+ * DESCRIPTION
+ *   Look up the page directory of @asid for the VPNs from
+ *   (@index * NR_PTES_PER_PAGE).
+ *
+ * RETURN VALUE
+ *   Return the page directory if cached, NULL otherwise.
+ */
+struct pte_directory *lookup_pwc(unsigned int asid, unsigned long index);
+
+/***********************************************************************
+ * fill_pwc()
+ *
+ * DESCRIPTION
+ *   Cache the page directory @pd of @asid at @index.
+ */
+void fill_pwc(unsigned int asid, unsigned long index, struct pte_directory *pd);
+
+/***********************************************************************
+ * invalidate_pwc()
+ *
+ * DESCRIPTION
+ *   Drop the cached page directory at @index of @asid. Should be called
+ *   when the page directory is released or replaced.
+ */
+void invalidate_pwc(unsigned int asid, unsigned long index);
+
+/***********************************************************************
+ * flush_pwc()
+ *
+ * DESCRIPTION
+ *   Drop all cached page directories.
+ */
+void flush_pwc(void);
+
+#endif
@@ -0,0 +1,422 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "reclaim.h"
+
+struct reclaim_stat reclaim_stat = { 0 };
+
+/**
+ * Page frame tracked by the replacement policy. @queue is the index to
+ * @resident it is in, or -1 if not tracked.
+ */
+struct frame_info {
+	unsigned int pid;
+	unsigned long vpn;
+	int queue;
+	unsigned long last_use;		/* Virtual time of the last use for wsclock */
+	struct list_head list;
+};
+
+/**
+ * Page evicted recently. Found by (@pid, @vpn) through @ghost_hash when the
+ * page is faulted in again.
+ */
+struct ghost {
+	unsigned int pid;
+	unsigned long vpn;
+	int queue;
+	struct list_head list;
+	struct hlist_node hnode;
+};
+
+/**
+ * Resident and ghost queues, from the oldest to the newest. Each policy
+ * gives them its own meanings;
+ *   - fifo, clock, second, wsclock: resident[0]
+ *   - 2q: A1in and Am in resident[0] and resident[1], A1out in ghosts[0]
+ *   - arc: T1 and T2 in resident[], B1 and B2 in ghosts[]
+ */
+static struct list_head resident[2];
+static unsigned long nr_resident[2];
+static struct list_head ghosts[2];
+static unsigned long nr_ghosts[2];
+
+static struct frame_info *frames = NULL;
+static unsigned int nr_frames = 0;
+
+static struct hlist_head *ghost_hash = NULL;
+static unsigned int ghost_hash_shift = 0;
+
+static unsigned int hand = 0;		/* Clock hand over the PFNs */
+static unsigned long arc_p = 0;		/* Target size of T1 */
+
+struct reclaim_policy {
+	const char *name;
+	void (*insert)(struct frame_info *f, struct ghost *g);
+	struct frame_info *(*victim)(unsigned int pinned);
+};
+
+
+static inline unsigned int __pfn(struct frame_info *f)
+{
+	return f - frames;
+}
+
+static void __enqueue(struct frame_info *f, int queue)
+{
+	f->queue = queue;
+	list_add_tail(&f->list, resident + queue);
+	nr_resident[queue]++;
+}
+
+static void __dequeue(struct frame_info *f)
+{
+	list_del_init(&f->list);
+	nr_resident[f->queue]--;
+	f->queue = -1;
+}
+
+static void __requeue(struct frame_info *f, int queue)
+{
+	__dequeue(f);
+	__enqueue(f, queue);
+}
+
+static inline struct hlist_head *__ghost_bucket(unsigned int pid, unsigned long vpn)
+{
+	unsigned long key = vpn ^ (pid * 0x9e3779b97f4a7c15UL);
+
+	return ghost_hash + ((key * 0x9e3779b97f4a7c15UL) >> (BITS_PER_LONG - ghost_hash_shift));
+}
+
+static struct ghost *__find_ghost(unsigned int pid, unsigned long vpn)
+{
+	struct ghost *g;
+
+	hlist_for_each_entry(g, __ghost_bucket(pid, vpn), hnode) {
+		if (g->pid == pid && g->vpn == vpn) return g;
+	}
+	return NULL;
+}
+
+static void __add_ghost(struct frame_info *f, int queue)
+{
+	struct ghost *g = malloc(sizeof(*g));
+
+	g->pid = f->pid;
+	g->vpn = f->vpn;
+	g->queue = queue;
+	list_add_tail(&g->list, ghosts + queue);
+	hlist_add_head(&g->hnode, __ghost_bucket(g->pid, g->vpn));
+	nr_ghosts[queue]++;
+}
+
+static void __drop_ghost(struct ghost *g)
+{
+	list_del(&g->list);
+	hlist_del(&g->hnode);
+	nr_ghosts[g->queue]--;
+	free(g);
+}
+
+static void __trim_ghosts(int queue, unsigned long max)
+{
+	while (nr_ghosts[queue] > max) {
+		__drop_ghost(list_first_entry(ghosts + queue, struct ghost, list));
+	}
+}
+
+/**
+ * Take the oldest frame of @queue but @pinned. When @check_ref is set, the
+ * referenced frames are moved to the tail of @queue to have a second chance.
+ */
+static struct frame_info *__second_chance(int queue, unsigned int pinned, bool check_ref)
+{
+	unsigned long nr = nr_resident[queue] * 2;
+
+	for (unsigned long i = 0; i < nr; i++) {
+		struct frame_info *f = list_first_entry(resident + queue, struct frame_info, list);
+
+		if (__pfn(f) == pinned || (check_ref && frame_referenced(__pfn(f)))) {
+			__requeue(f, queue);
+			continue;
+		}
+		return f;
+	}
+	return NULL;
+}
+
+
+static void __default_insert(struct frame_info *f, struct ghost *g)
+{
+	(void)g;
+
+	__enqueue(f, 0);
+}
+
+static struct frame_info *__fifo_victim(unsigned int pinned)
+{
+	struct frame_info *f;
+
+	list_for_each_entry(f, resident, list) {
+		if (__pfn(f) != pinned) return f;
+	}
+	return NULL;
+}
+
+static struct frame_info *__clock_victim(unsigned int pinned)
+{
+	for (unsigned int i = 0; i < nr_frames * 2; i++) {
+		struct frame_info *f = frames + hand;
+
+		hand = (hand + 1) % nr_frames;
+		if (f->queue < 0 || __pfn(f) == pinned) continue;
+		if (frame_referenced(__pfn(f))) continue;
+
+		return f;
+	}
+	return NULL;
+}
+
+static struct frame_info *__second_victim(unsigned int pinned)
+{
+	return __second_chance(0, pinned, true);
+}
+
+
+/* 2Q with the sizes of A1in and A1out tuned as the paper suggests */
+#define TWOQ_A1IN	0
+#define TWOQ_AM		1
+
+static void __2q_insert(struct frame_info *f, struct ghost *g)
+{
+	__enqueue(f, g ? TWOQ_AM : TWOQ_A1IN);
+}
+
+static struct frame_info *__2q_victim(unsigned int pinned)
+{
+	unsigned long kin = nr_frames / 4 ? nr_frames / 4 : 1;
+	unsigned long kout = nr_frames / 2 ? nr_frames / 2 : 1;
+	struct frame_info *f = NULL;
+
+	/* Am is managed in LRU, approximated with the reference bits */
+	if (nr_resident[TWOQ_A1IN] <= kin) {
+		f = __second_chance(TWOQ_AM, pinned, true);
+		if (f) return f;
+	}
+
+	/* Pages evicted from A1in are remembered in A1out */
+	f = __second_chance(TWOQ_A1IN, pinned, false);
+	if (f) {
+		__add_ghost(f, 0);
+		__trim_ghosts(0, kout);
+		return f;
+	}
+	return __second_chance(TWOQ_AM, pinned, true);
+}
+
+
+#define ARC_T1	0
+#define ARC_T2	1
+#define ARC_B1	0
+#define ARC_B2	1
+
+static void __arc_insert(struct frame_info *f, struct ghost *g)
+{
+	unsigned long c = nr_frames;
+
+	if (!g) {
+		/* Replace the ghost directory to keep |T1|+|B1| <= c and total <= 2c */
+		if (nr_resident[ARC_T1] + nr_ghosts[ARC_B1] >= c && nr_ghosts[ARC_B1]) {
+			__trim_ghosts(ARC_B1, nr_ghosts[ARC_B1] - 1);
+		} else if (nr_resident[ARC_T1] + nr_resident[ARC_T2] +
+				nr_ghosts[ARC_B1] + nr_ghosts[ARC_B2] >= 2 * c && nr_ghosts[ARC_B2]) {
+			__trim_ghosts(ARC_B2, nr_ghosts[ARC_B2] - 1);
+		}
+		__enqueue(f, ARC_T1);
+		return;
+	}
+
+	/* A hit on B1 favors recency, and a hit on B2 favors frequency */
+	if (g->queue == ARC_B1) {
+		unsigned long delta = nr_ghosts[ARC_B2] / nr_ghosts[ARC_B1];
+
+		arc_p += delta ? delta : 1;
+		if (arc_p > c) arc_p = c;
+	} else {
+		unsigned long delta = nr_ghosts[ARC_B1] / nr_ghosts[ARC_B2];
+
+		if (!delta) delta = 1;
+		arc_p = arc_p > delta ? arc_p - delta : 0;
+	}
+	__enqueue(f, ARC_T2);
+}
+
+static struct frame_info *__arc_victim(unsigned int pinned)
+{
+	unsigned long nr = (nr_resident[ARC_T1] + nr_resident[ARC_T2]) * 2 + 1;
+
+	/* Everything is swapped out already */
+	if (!nr_resident[ARC_T1] && !nr_resident[ARC_T2]) return NULL;
+
+	for (unsigned long i = 0; i < nr; i++) {
+		int queue = ARC_T2;
+		struct frame_info *f;
+
+		if (nr_resident[ARC_T1] &&
+				(nr_resident[ARC_T1] >= (arc_p ? arc_p : 1) || !nr_resident[ARC_T2])) {
+			queue = ARC_T1;
+		}
+		f = list_first_entry(resident + queue, struct frame_info, list);
+
+		if (__pfn(f) == pinned) {
+			__requeue(f, queue);
+			continue;
+		}
+
+		/* Referenced pages go to T2 as they are used more than once */
+		if (frame_referenced(__pfn(f))) {
+			__requeue(f, ARC_T2);
+			continue;
+		}
+
+		__add_ghost(f, queue == ARC_T1 ? ARC_B1 : ARC_B2);
+		return f;
+	}
+	return NULL;
+}
+
+
+static struct frame_info *__wsclock_victim(unsigned int pinned)
+{
+	unsigned long tau = (unsigned long)WSCLOCK_TAU * nr_frames;
+	struct frame_info *oldest = NULL;
+	struct frame_info *oldest_dirty = NULL;
+
+	for (unsigned int i = 0; i < nr_frames * 2; i++) {
+		struct frame_info *f = frames + hand;
+
+		hand = (hand + 1) % nr_frames;
+		if (f->queue < 0 || __pfn(f) == pinned) continue;
+
+		if (frame_referenced(__pfn(f))) {
+			f->last_use = reclaim_stat.accesses;
+			continue;
+		}
+
+		if (reclaim_stat.accesses - f->last_use > tau) {
+			/* Out of the working set. Evict it unless it needs writing */
+			if (!frame_dirty(__pfn(f))) return f;
+
+			if (!oldest_dirty || f->last_use < oldest_dirty->last_use) oldest_dirty = f;
+		}
+		if (!oldest || f->last_use < oldest->last_use) oldest = f;
+	}
+
+	/* No clean page out of the working set */
+	return oldest_dirty ? oldest_dirty : oldest;
+}
+
+
+static const struct reclaim_policy reclaim_policies[] = {
+	{ "clock", __default_insert, __clock_victim },
+	{ "fifo", __default_insert, __fifo_victim },
+	{ "second", __default_insert, __second_victim },
+	{ "2q", __2q_insert, __2q_victim },
+	{ "arc", __arc_insert, __arc_victim },
+	{ "wsclock", __default_insert, __wsclock_victim },
+};
+static const struct reclaim_policy *reclaim_policy = reclaim_policies;
+
+bool set_reclaim_policy(const char *name)
+{
+	for (int i = 0; i < sizeof(reclaim_policies) / sizeof(*reclaim_policies); i++) {
+		if (strcmp(reclaim_policies[i].name, name) == 0) {
+			reclaim_policy = reclaim_policies + i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *reclaim_policy_name(void)
+{
+	return reclaim_policy->name;
+}
+
+void init_reclaim(unsigned int nr)
+{
+	nr_frames = nr;
+	frames = calloc(nr, sizeof(*frames));
+	for (unsigned int i = 0; i < nr; i++) {
+		frames[i].queue = -1;
+		INIT_LIST_HEAD(&frames[i].list);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		INIT_LIST_HEAD(resident + i);
+		INIT_LIST_HEAD(ghosts + i);
+	}
+
+	/* Ghosts are no more than the page frames */
+	for (ghost_hash_shift = 1; (1U << ghost_hash_shift) < nr; ghost_hash_shift++);
+	ghost_hash = calloc(1U << ghost_hash_shift, sizeof(*ghost_hash));
+}
+
+void reclaim_tick(void)
+{
+	reclaim_stat.accesses++;
+}
+
+void reclaim_insert(unsigned int pfn, unsigned int pid, unsigned long vpn)
+{
+	struct frame_info *f = frames + pfn;
+	struct ghost *g;
+
+	if (f->queue >= 0) return;
+
+	f->pid = pid;
+	f->vpn = vpn;
+	f->last_use = reclaim_stat.accesses;
+
+	g = __find_ghost(pid, vpn);
+	if (g) reclaim_stat.ghost_hits++;
+
+	reclaim_policy->insert(f, g);
+	if (g) __drop_ghost(g);
+}
+
+void reclaim_remove(unsigned int pfn)
+{
+	struct frame_info *f = frames + pfn;
+
+	if (f->queue >= 0) __dequeue(f);
+}
+
+unsigned int reclaim_victim(unsigned int pinned)
+{
+	struct frame_info *f = reclaim_policy->victim(pinned);
+
+	if (!f) return -1;
+
+	__dequeue(f);
+	return __pfn(f);
+}
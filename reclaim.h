@@ -0,0 +1,127 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __RECLAIM_H__
+#define __RECLAIM_H__
+
+#include "types.h"
+
+/**
+ * Page replacement. Page frames mapped to processes are tracked by the
+ * replacement policy, which picks the victim to swap out when the frame
+ * allocator runs dry. The policies are;
+ *   - fifo evicts the frame mapped first
+ *   - clock sweeps the frames in the PFN order, sparing the referenced ones
+ *   - second gives the referenced frames a second chance in the FIFO order
+ *   - 2q admits new pages to a FIFO queue, and promotes the pages faulted
+ *     again soon after being evicted to the main queue
+ *   - arc balances the recency and frequency queues adaptively by the hits
+ *     on their ghost queues (CAR, the CLOCK approximation of ARC)
+ *   - wsclock sweeps the frames like clock, sparing the pages used within
+ *     the working set window, and prefers clean pages
+ * Recently evicted pages are remembered as ghosts by their pid and VPN.
+ *
+ * Whether a frame is referenced or dirty is told by the memory manager
+ * through frame_referenced() and frame_dirty(), which look into the
+ * accessed and dirty bits of the PTEs mapping the frame.
+ */
+
+/* Working set window of wsclock in accesses, per page frame */
+#define WSCLOCK_TAU	1
+
+struct reclaim_stat {
+	unsigned long accesses;
+	unsigned long faults;		/* Page faults */
+	unsigned long evictions;
+	unsigned long clean_evictions;	/* Evictions without writing to swap */
+	unsigned long ghost_hits;
+};
+extern struct reclaim_stat reclaim_stat;
+
+
+/***********************************************************************
+ * set_reclaim_policy()
+ *
+ * DESCRIPTION
+ *   Choose the page replacement policy by @name, which is one of "fifo",
+ *   "clock" (default), "second", "2q", "arc", and "wsclock".
+ *
+ * RETURN VALUE
+ *   Return true on success, false if there is no such policy.
+ */
+bool set_reclaim_policy(const char *name);
+
+/***********************************************************************
+ * reclaim_policy_name()
+ *
+ * RETURN VALUE
+ *   Return the name of the current page replacement policy.
+ */
+const char *reclaim_policy_name(void);
+
+/***********************************************************************
+ * init_reclaim()
+ *
+ * DESCRIPTION
+ *   Set up the replacement policy for @nr_frames page frames.
+ */
+void init_reclaim(unsigned int nr_frames);
+
+/***********************************************************************
+ * reclaim_tick()
+ *
+ * DESCRIPTION
+ *   Account a memory access, which advances the virtual time of wsclock.
+ */
+void reclaim_tick(void);
+
+/***********************************************************************
+ * reclaim_insert()
+ *
+ * DESCRIPTION
+ *   Start tracking the page frame @pfn just mapped to @vpn of @pid.
+ */
+void reclaim_insert(unsigned int pfn, unsigned int pid, unsigned long vpn);
+
+/***********************************************************************
+ * reclaim_remove()
+ *
+ * DESCRIPTION
+ *   Stop tracking the page frame @pfn, which is being freed.
+ */
+void reclaim_remove(unsigned int pfn);
+
+/***********************************************************************
+ * reclaim_victim()
+ *
+ * DESCRIPTION
+ *   Pick the page frame to evict but @pinned. The victim is not tracked
+ *   anymore; put it back with reclaim_insert() if it cannot be evicted.
+ *
+ * RETURN VALUE
+ *   Return the PFN of the victim, or -1 if no frame can be evicted.
+ */
+unsigned int reclaim_victim(unsigned int pinned);
+
+
+/**
+ * Provided by the memory manager. frame_referenced() tests and clears the
+ * accessed bits of the PTEs mapping @pfn, and frame_dirty() tests their
+ * dirty bits.
+ */
+bool frame_referenced(unsigned int pfn);
+bool frame_dirty(unsigned int pfn);
+
+#endif
@@ -0,0 +1,205 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "swap.h"
+
+struct swap_stat swap_stat = { 0 };
+
+static int swap_fd = -1;
+static unsigned long swap_page_size = 0;
+static void *swap_buffer = NULL;
+
+/* Reference count of each slot, grown on demand */
+static unsigned int *swap_map = NULL;
+static unsigned int nr_slots = 0;
+
+/**
+ * Free slots. @free_slots[0] has a bit for each slot, and @free_slots[1] has
+ * a bit for each word of @free_slots[0] with a free slot in it.
+ */
+static unsigned long *free_slots[2] = { NULL, NULL };
+
+/**
+ * A page written out begins with this header so that swap_in() can tell
+ * whether it reads back the page it wrote. The simulator has no page
+ * contents, so the rest of the page is left as zeros.
+ */
+struct swap_header {
+	unsigned int magic;
+	unsigned long vpn;
+};
+#define SWAP_MAGIC	0x53574150	/* "SWAP" */
+
+static void __account_io(void)
+{
+	swap_stat.io_us += SWAP_IO_LATENCY + (double)swap_page_size / SWAP_IO_BANDWIDTH;
+}
+
+bool init_swap(const char *path, unsigned long page_size)
+{
+	if (page_size < sizeof(struct swap_header)) return false;
+
+	swap_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (swap_fd < 0) return false;
+
+	swap_page_size = page_size;
+	swap_buffer = calloc(1, page_size);
+	return true;
+}
+
+bool swap_enabled(void)
+{
+	return swap_fd >= 0;
+}
+
+static void __set_slot_free(unsigned int slot)
+{
+	unsigned int word = slot / BITS_PER_LONG;
+
+	if (!free_slots[0][word]) {
+		free_slots[1][word / BITS_PER_LONG] |= 1UL << (word % BITS_PER_LONG);
+	}
+	free_slots[0][word] |= 1UL << (slot % BITS_PER_LONG);
+}
+
+static void __clear_slot_free(unsigned int slot)
+{
+	unsigned int word = slot / BITS_PER_LONG;
+
+	free_slots[0][word] &= ~(1UL << (slot % BITS_PER_LONG));
+	if (!free_slots[0][word]) {
+		free_slots[1][word / BITS_PER_LONG] &= ~(1UL << (word % BITS_PER_LONG));
+	}
+}
+
+/**
+ * Return the lowest free slot, or -1 if all slots are in use
+ */
+static unsigned int __find_free_slot(void)
+{
+	unsigned int nr_words = nr_slots / BITS_PER_LONG;
+
+	for (unsigned int i = 0; i * BITS_PER_LONG < nr_words; i++) {
+		unsigned int word;
+
+		if (!free_slots[1][i]) continue;
+
+		word = i * BITS_PER_LONG + __builtin_ctzl(free_slots[1][i]);
+		return word * BITS_PER_LONG + __builtin_ctzl(free_slots[0][word]);
+	}
+	return -1;
+}
+
+/**
+ * Double the slots, which are a multiple of BITS_PER_LONG, and mark the new
+ * ones free
+ */
+static void __grow_slots(void)
+{
+	unsigned int nr = nr_slots ? nr_slots * 2 : BITS_PER_LONG;
+	unsigned int old_words = nr_slots / BITS_PER_LONG;
+	unsigned int nr_words = nr / BITS_PER_LONG;
+	unsigned int old_summary = (old_words + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	unsigned int nr_summary = (nr_words + BITS_PER_LONG - 1) / BITS_PER_LONG;
+
+	swap_map = realloc(swap_map, sizeof(*swap_map) * nr);
+	memset(swap_map + nr_slots, 0, sizeof(*swap_map) * (nr - nr_slots));
+
+	free_slots[0] = realloc(free_slots[0], sizeof(unsigned long) * nr_words);
+	free_slots[1] = realloc(free_slots[1], sizeof(unsigned long) * nr_summary);
+	memset(free_slots[1] + old_summary, 0,
+			sizeof(unsigned long) * (nr_summary - old_summary));
+
+	for (unsigned int word = old_words; word < nr_words; word++) {
+		free_slots[0][word] = ~0UL;
+		free_slots[1][word / BITS_PER_LONG] |= 1UL << (word % BITS_PER_LONG);
+	}
+	nr_slots = nr;
+}
+
+/**
+ * Find a free slot, growing @swap_map when all slots are in use
+ */
+static unsigned int __alloc_slot(void)
+{
+	unsigned int slot = __find_free_slot();
+
+	if (slot == -1) {
+		__grow_slots();
+		slot = __find_free_slot();
+	}
+
+	__clear_slot_free(slot);
+	swap_map[slot] = 1;
+	swap_stat.slots++;
+	return slot;
+}
+
+unsigned int swap_out(unsigned long vpn)
+{
+	struct swap_header *header = swap_buffer;
+	unsigned int slot;
+
+	if (swap_fd < 0) return -1;
+
+	slot = __alloc_slot();
+
+	header->magic = SWAP_MAGIC;
+	header->vpn = vpn;
+	if (pwrite(swap_fd, swap_buffer, swap_page_size, (off_t)slot * swap_page_size) < 0) {
+		put_swap(slot);
+		return -1;
+	}
+
+	swap_stat.swap_outs++;
+	__account_io();
+	return slot;
+}
+
+bool swap_in(unsigned int slot, unsigned long vpn)
+{
+	struct swap_header *header = swap_buffer;
+
+	if (swap_fd < 0 || slot >= nr_slots || !swap_map[slot]) return false;
+
+	if (pread(swap_fd, swap_buffer, swap_page_size, (off_t)slot * swap_page_size) < 0) {
+		return false;
+	}
+	if (header->magic != SWAP_MAGIC || header->vpn != vpn) return false;
+
+	swap_stat.swap_ins++;
+	__account_io();
+	return true;
+}
+
+void get_swap(unsigned int slot)
+{
+	swap_map[slot]++;
+}
+
+void put_swap(unsigned int slot)
+{
+	if (--swap_map[slot]) return;
+
+	__set_slot_free(slot);
+	swap_stat.slots--;
+}
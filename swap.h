@@ -0,0 +1,99 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __SWAP_H__
+#define __SWAP_H__
+
+#include "types.h"
+
+/**
+ * Swap area backed by a local file. The file is divided into slots of a
+ * page each, and slot s is at offset (s * page size). Each slot has a
+ * reference count of the PTEs pointing to it, as forked processes share
+ * the swapped pages of their parent, and is released when the count drops
+ * to zero.
+ *
+ * A swap-in or swap-out takes SWAP_IO_LATENCY us plus the transfer time of
+ * a page at SWAP_IO_BANDWIDTH MB/s in the I/O cost model.
+ */
+#define SWAP_IO_LATENCY		100
+#define SWAP_IO_BANDWIDTH	500
+
+struct swap_stat {
+	unsigned long swap_ins;
+	unsigned long swap_outs;
+	unsigned long slots;		/* Slots in use */
+	double io_us;			/* Modeled I/O time in us */
+};
+extern struct swap_stat swap_stat;
+
+
+/***********************************************************************
+ * init_swap()
+ *
+ * DESCRIPTION
+ *   Use the file at @path as the swap area for pages of @page_size bytes.
+ *   The file is created or truncated.
+ *
+ * RETURN VALUE
+ *   Return true on success, false if the file cannot be opened.
+ */
+bool init_swap(const char *path, unsigned long page_size);
+
+/***********************************************************************
+ * swap_enabled()
+ *
+ * RETURN VALUE
+ *   Return true if the swap area is set up.
+ */
+bool swap_enabled(void);
+
+/***********************************************************************
+ * swap_out()
+ *
+ * DESCRIPTION
+ *   Write the page at @vpn to a free slot of the swap area. The slot gets
+ *   a reference count of 1.
+ *
+ * RETURN VALUE
+ *   Return the slot, or -1 if the page cannot be written.
+ */
+unsigned int swap_out(unsigned long vpn);
+
+/***********************************************************************
+ * swap_in()
+ *
+ * DESCRIPTION
+ *   Read the page at @vpn back from @slot. The reference of the PTE to
+ *   @slot is not dropped, and the caller takes it over. It may put_swap()
+ *   the reference, or keep it as a swap cache to drop a clean page without
+ *   writing it out again, as the memory manager does.
+ *
+ * RETURN VALUE
+ *   Return true on success, false if @slot does not hold the page.
+ */
+bool swap_in(unsigned int slot, unsigned long vpn);
+
+/***********************************************************************
+ * get_swap()/put_swap()
+ *
+ * DESCRIPTION
+ *   Add or remove a reference to @slot. The slot becomes free when the last
+ *   reference is removed.
+ */
+void get_swap(unsigned int slot);
+void put_swap(unsigned int slot);
+
+#endif
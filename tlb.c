@@ -0,0 +1,715 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "tlb.h"
+
+/* Included after list_head.h, which would redefine offsetof otherwise */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+struct tlb *tlbs[NR_TLB_LEVELS] = { NULL };
+unsigned int nr_tlb_levels = 0;
+
+/**
+ * Replacement state of a TLB set. @gen is the TLB generation at which the
+ * stale entries were last swept out of the set. The entries holding no
+ * translation are in @free, and valid entries are tracked by the replacement policy through
+ * their @set_list;
+ *   - FIFO and LRU keep them in @order from the victim to the most recent
+ *   - CLOCK sweeps the ways with @hand over the @referenced bits
+ *   - LFU groups them by @freq into @freqs[], least recently used first,
+ *     and @min_freq points to the lowest non-empty group
+ */
+struct tlb_set {
+	unsigned long gen;
+	struct list_head free;
+	struct list_head order;
+	unsigned int hand;
+	unsigned int min_freq;
+	struct list_head *freqs;
+};
+
+/* LFU counters saturate at this value as 4-bit hardware counters would */
+#define TLB_LFU_MAX_FREQ	15
+
+/**
+ * Sets with more ways than this are looked up through the hash index.
+ * Narrower sets are scanned with the key matcher below in one or two vector
+ * compares, which keeps up with the hash index. Wider sets do not gain from
+ * the scan even with 16 keys matched at once: from 64 ways up the scan is
+ * mostly slower, and fully-associative TLBs of 1K to 4K entries run up to
+ * 2.7x slower with it, as each miss compares all the ways.
+ */
+#define TLB_SCAN_MAX_WAYS	16
+
+static inline struct hlist_head *__tlb_bucket(struct tlb *tlb, unsigned int asid, unsigned long vpn)
+{
+	/* Fibonacci hashing to spread consecutive VPNs over the buckets */
+	unsigned long key = vpn ^ ((unsigned long)asid << (BITS_PER_LONG - 1 - ASID_BITS));
+
+	return tlb->hash + ((key * 0x9e3779b97f4a7c15UL) >> (BITS_PER_LONG - tlb->hash_shift));
+}
+
+static inline struct tlb_set *__tlb_set(struct tlb *tlb, struct tlb_entry *t)
+{
+	return tlb->sets + (t - tlb->entries) / tlb->nr_ways;
+}
+
+static inline unsigned long *__tlb_valid(struct tlb *tlb, unsigned int index)
+{
+	unsigned int way = index % tlb->nr_ways;
+
+	return tlb->valid + (index / tlb->nr_ways) * tlb->valid_words + way / BITS_PER_LONG;
+}
+
+
+/**
+ * The 32-bit key of (@asid, @vpn) in @keys. The upper half of @vpn, where the
+ * superpage keys have their tag, is folded into the lower one, and @asid
+ * goes to the top bits so that the entries of other address spaces mostly
+ * fail the match. Keys may collide, so a matching key is confirmed with the
+ * full VPN and the ASID.
+ */
+static inline uint32_t __tlb_key(unsigned int asid, unsigned long vpn)
+{
+	return (uint32_t)(vpn ^ (vpn >> 32)) ^ ((uint32_t)asid << (32 - ASID_BITS));
+}
+
+/**
+ * Key matchers. Compare @nr (<= BITS_PER_LONG) packed keys in @keys against
+ * @key and return the bitmask of the matching lanes. The widest one the CPU
+ * supports is picked at runtime in init_tlb().
+ */
+static unsigned long __match_scalar(const uint32_t *keys, unsigned int nr, uint32_t key)
+{
+	unsigned long mask = 0;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		mask |= (unsigned long)(keys[i] == key) << i;
+	}
+	return mask;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+static unsigned long __match_sse2(const uint32_t *keys, unsigned int nr, uint32_t key)
+{
+	__m128i k = _mm_set1_epi32(key);
+	unsigned long mask = 0;
+	unsigned int i;
+
+	for (i = 0; i + 4 <= nr; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+
+		mask |= (unsigned long)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, k))) << i;
+	}
+	if (i < nr) mask |= __match_scalar(keys + i, nr - i, key) << i;
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static unsigned long __match_avx2(const uint32_t *keys, unsigned int nr, uint32_t key)
+{
+	__m256i k = _mm256_set1_epi32(key);
+	unsigned long mask = 0;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= nr; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+
+		mask |= (unsigned long)_mm256_movemask_ps(
+				_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, k))) << i;
+	}
+	if (i < nr) mask |= __match_scalar(keys + i, nr - i, key) << i;
+	return mask;
+}
+
+__attribute__((target("avx512f")))
+static unsigned long __match_avx512(const uint32_t *keys, unsigned int nr, uint32_t key)
+{
+	__m512i k = _mm512_set1_epi32(key);
+	unsigned long mask = 0;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= nr; i += 16) {
+		__m512i v = _mm512_loadu_si512((const void *)(keys + i));
+
+		mask |= (unsigned long)_mm512_cmpeq_epi32_mask(v, k) << i;
+	}
+	if (i < nr) mask |= __match_scalar(keys + i, nr - i, key) << i;
+	return mask;
+}
+#endif
+
+static struct {
+	const char *name;
+	unsigned int lanes;
+	unsigned long (*match)(const uint32_t *keys, unsigned int nr, uint32_t key);
+} tlb_matcher = { "scalar", 1, __match_scalar };
+
+static void __init_tlb_matcher(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		tlb_matcher.name = "avx512";
+		tlb_matcher.lanes = 16;
+		tlb_matcher.match = __match_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		tlb_matcher.name = "avx2";
+		tlb_matcher.lanes = 8;
+		tlb_matcher.match = __match_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		tlb_matcher.name = "sse2";
+		tlb_matcher.lanes = 4;
+		tlb_matcher.match = __match_sse2;
+	}
+#endif
+}
+
+const char *tlb_matcher_name(void)
+{
+	return tlb_matcher.name;
+}
+
+static inline struct tlb_entry *__tlb_ways(struct tlb *tlb, struct tlb_set *set)
+{
+	return tlb->entries + (set - tlb->sets) * tlb->nr_ways;
+}
+
+
+/**
+ * Replacement policies. @fill is called when @t gets a new translation,
+ * @touch on every TLB hit to @t, and @remove when @t is invalidated or
+ * evicted. @victim picks the entry to evict from a full @set. All of them
+ * run in O(1) or amortized O(1).
+ */
+struct tlb_policy {
+	const char *name;
+	void (*fill)(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t);
+	void (*touch)(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t);
+	void (*remove)(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t);
+	struct tlb_entry *(*victim)(struct tlb *tlb, struct tlb_set *set);
+};
+
+static void __order_fill(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+
+	list_move_tail(&t->set_list, &set->order);
+}
+
+static void __order_remove(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+
+	list_move(&t->set_list, &set->free);
+}
+
+static struct tlb_entry *__order_victim(struct tlb *tlb, struct tlb_set *set)
+{
+	(void)tlb;
+
+	return list_first_entry(&set->order, struct tlb_entry, set_list);
+}
+
+static void __fifo_touch(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+	(void)set;
+	(void)t;
+}
+
+static void __lru_touch(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+
+	list_move_tail(&t->set_list, &set->order);
+}
+
+static void __clock_fill(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+	(void)set;
+
+	list_del_init(&t->set_list);
+	t->referenced = true;
+}
+
+static void __clock_touch(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+	(void)set;
+
+	t->referenced = true;
+}
+
+static struct tlb_entry *__clock_victim(struct tlb *tlb, struct tlb_set *set)
+{
+	struct tlb_entry *ways = __tlb_ways(tlb, set);
+
+	/* Give a second chance to the referenced ones. Ends in two rounds */
+	while (true) {
+		struct tlb_entry *t = ways + set->hand;
+
+		set->hand = (set->hand + 1) % tlb->nr_ways;
+		if (!t->referenced) return t;
+		t->referenced = false;
+	}
+}
+
+static void __random_fill(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+	(void)set;
+
+	list_del_init(&t->set_list);
+}
+
+static struct tlb_entry *__random_victim(struct tlb *tlb, struct tlb_set *set)
+{
+	return __tlb_ways(tlb, set) + rand() % tlb->nr_ways;
+}
+
+static void __lfu_fill(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+
+	t->freq = 1;
+	set->min_freq = 1;
+	list_move_tail(&t->set_list, set->freqs + 1);
+}
+
+static void __lfu_touch(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+
+	if (t->freq == TLB_LFU_MAX_FREQ) {
+		list_move_tail(&t->set_list, set->freqs + t->freq);
+		return;
+	}
+
+	if (set->min_freq == t->freq && list_is_singular(set->freqs + t->freq)) {
+		set->min_freq++;
+	}
+	t->freq++;
+	list_move_tail(&t->set_list, set->freqs + t->freq);
+}
+
+static void __lfu_remove(struct tlb *tlb, struct tlb_set *set, struct tlb_entry *t)
+{
+	(void)tlb;
+
+	list_move(&t->set_list, &set->free);
+
+	/* Bounded by TLB_LFU_MAX_FREQ */
+	while (set->min_freq < TLB_LFU_MAX_FREQ &&
+			list_empty(set->freqs + set->min_freq)) {
+		set->min_freq++;
+	}
+}
+
+static struct tlb_entry *__lfu_victim(struct tlb *tlb, struct tlb_set *set)
+{
+	(void)tlb;
+
+	return list_first_entry(set->freqs + set->min_freq, struct tlb_entry, set_list);
+}
+
+static const struct tlb_policy tlb_policies[] = {
+	{ "fifo", __order_fill, __fifo_touch, __order_remove, __order_victim },
+	{ "lru", __order_fill, __lru_touch, __order_remove, __order_victim },
+	{ "clock", __clock_fill, __clock_touch, __order_remove, __clock_victim },
+	{ "random", __random_fill, __fifo_touch, __order_remove, __random_victim },
+	{ "lfu", __lfu_fill, __lfu_touch, __lfu_remove, __lfu_victim },
+};
+static const struct tlb_policy *tlb_policy = tlb_policies;
+
+bool set_tlb_policy(const char *name)
+{
+	for (int i = 0; i < sizeof(tlb_policies) / sizeof(*tlb_policies); i++) {
+		if (strcmp(tlb_policies[i].name, name) == 0) {
+			tlb_policy = tlb_policies + i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *tlb_policy_name(void)
+{
+	return tlb_policy->name;
+}
+
+
+static void __invalidate_tlb_entry(struct tlb *tlb, struct tlb_entry *t)
+{
+	unsigned int index = t - tlb->entries;
+
+	if (tlb->hash) hlist_del_init(&t->hnode);
+	list_del_init(&t->list);
+	list_del_init(&t->asid_list);
+	tlb_policy->remove(tlb, __tlb_set(tlb, t), t);
+
+	*__tlb_valid(tlb, index) &= ~(1UL << (index % tlb->nr_ways % BITS_PER_LONG));
+	tlb->vpns[index] = 0;
+	tlb->keys[index] = 0;
+	tlb->asids[index] = 0;
+
+	if (t->huge) tlb->nr_huge--;
+
+	t->pfn = 0;
+	t->writable = false;
+	t->cow = false;
+	t->huge = false;
+	t->prefetched = false;
+	t->referenced = false;
+	t->freq = 0;
+}
+
+static struct tlb_entry *__find_tlb(struct tlb *tlb, unsigned int asid, unsigned long vpn)
+{
+	unsigned int set = vpn & (tlb->nr_sets - 1);
+	unsigned int base = set * tlb->nr_ways;
+	const unsigned long *valid = tlb->valid + set * tlb->valid_words;
+	struct tlb_entry *t;
+	uint32_t key;
+
+	/* Nothing but stale entries since the last flush */
+	if (tlb->sets[set].gen != tlb->gen) return NULL;
+
+	if (tlb->hash) {
+		hlist_for_each_entry(t, __tlb_bucket(tlb, asid, vpn), hnode) {
+			unsigned int index = t - tlb->entries;
+
+			tlb->stat.probes++;
+			if (tlb->vpns[index] == vpn && tlb->asids[index] == asid &&
+					tlb->gens[index] == tlb->gen) return t;
+		}
+		return NULL;
+	}
+
+	/* Match the keys of the set a word of the validity bitmask at a time */
+	key = __tlb_key(asid, vpn);
+	for (unsigned int w = 0; w < tlb->valid_words; w++) {
+		unsigned int first = w * BITS_PER_LONG;
+		unsigned int nr = tlb->nr_ways - first;
+		unsigned long match;
+
+		if (nr > BITS_PER_LONG) nr = BITS_PER_LONG;
+
+		tlb->stat.probes += (nr + tlb_matcher.lanes - 1) / tlb_matcher.lanes;
+		match = tlb_matcher.match(tlb->keys + base + first, nr, key) & valid[w];
+
+		for (; match; match &= match - 1) {
+			unsigned int index = base + first + __builtin_ctzl(match);
+
+			if (tlb->vpns[index] == vpn && tlb->asids[index] == asid &&
+					tlb->gens[index] == tlb->gen) {
+				return tlb->entries + index;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reclaim the entries of @set that were left stale by flush_tlb(). Each set
+ * is swept once after a flush, when a translation is filled into it next.
+ */
+static void __sweep_tlb_set(struct tlb *tlb, struct tlb_set *set)
+{
+	unsigned int base = (set - tlb->sets) * tlb->nr_ways;
+	const unsigned long *valid = tlb->valid + (set - tlb->sets) * tlb->valid_words;
+
+	for (unsigned int w = 0; w < tlb->valid_words; w++) {
+		unsigned long stale = valid[w];
+
+		for (; stale; stale &= stale - 1) {
+			unsigned int index = base + w * BITS_PER_LONG + __builtin_ctzl(stale);
+
+			if (tlb->gens[index] != tlb->gen) {
+				__invalidate_tlb_entry(tlb, tlb->entries + index);
+			}
+		}
+	}
+	set->gen = tlb->gen;
+}
+
+static struct tlb_entry *__fill_tlb(struct tlb *tlb, unsigned int asid, unsigned long vpn,
+		unsigned int pfn, bool writable, bool cow)
+{
+	struct tlb_set *set = tlb->sets + (vpn & (tlb->nr_sets - 1));
+	struct tlb_entry *t;
+	unsigned int index;
+
+	if (set->gen != tlb->gen) __sweep_tlb_set(tlb, set);
+
+	/**
+	 * Holes left by invalidations are reused first. When every way of the
+	 * set is valid, the replacement policy picks the one to evict.
+	 */
+	if (list_empty(&set->free)) {
+		t = tlb_policy->victim(tlb, set);
+		if (t->prefetched) tlb->stat.prefetch_unused++;
+
+		__invalidate_tlb_entry(tlb, t);
+		tlb->stat.evictions++;
+	}
+	t = list_first_entry(&set->free, struct tlb_entry, set_list);
+	index = t - tlb->entries;
+
+	tlb->vpns[index] = vpn;
+	tlb->keys[index] = __tlb_key(asid, vpn);
+	tlb->asids[index] = asid;
+	tlb->gens[index] = tlb->gen;
+	*__tlb_valid(tlb, index) |= 1UL << (index % tlb->nr_ways % BITS_PER_LONG);
+
+	t->pfn = pfn;
+	t->writable = writable;
+	t->cow = cow;
+	t->huge = !!(vpn & TLB_HUGE_KEY(0));
+	if (t->huge) tlb->nr_huge++;
+	if (tlb->hash) hlist_add_head(&t->hnode, __tlb_bucket(tlb, asid, vpn));
+	tlb_policy->fill(tlb, set, t);
+	list_add_tail(&t->list, &tlb->fifo);
+	list_add_tail(&t->asid_list, tlb->asid_entries + asid);
+
+	tlb->stat.fills++;
+	return t;
+}
+
+bool init_tlb(const char *name, unsigned int sets, unsigned int ways, unsigned int latency)
+{
+	unsigned int nr_entries = sets * ways;
+	struct tlb *tlb;
+
+	if (!sets || !ways || (sets & (sets - 1))) return false;
+	if (nr_tlb_levels == NR_TLB_LEVELS) return false;
+
+	tlb = calloc(1, sizeof(*tlb));
+	tlb->name = name;
+	tlb->nr_sets = sets;
+	tlb->nr_ways = ways;
+	tlb->latency = latency;
+	INIT_LIST_HEAD(&tlb->fifo);
+	for (int i = 0; i < NR_ASIDS; i++) {
+		INIT_LIST_HEAD(tlb->asid_entries + i);
+	}
+
+	if (!nr_tlb_levels) __init_tlb_matcher();
+
+	tlb->entries = calloc(nr_entries, sizeof(*tlb->entries));
+	tlb->sets = calloc(sets, sizeof(*tlb->sets));
+
+	tlb->vpns = calloc(nr_entries, sizeof(*tlb->vpns));
+	tlb->keys = calloc(nr_entries, sizeof(*tlb->keys));
+	tlb->asids = calloc(nr_entries, sizeof(*tlb->asids));
+	tlb->gens = calloc(nr_entries, sizeof(*tlb->gens));
+	tlb->valid_words = (ways + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	tlb->valid = calloc(sets * tlb->valid_words, sizeof(*tlb->valid));
+
+	if (ways > TLB_SCAN_MAX_WAYS) {
+		/* Keep the load factor of the hash index below 1 */
+		for (tlb->hash_shift = 1; (1U << tlb->hash_shift) < nr_entries; tlb->hash_shift++);
+		tlb->hash = calloc(1U << tlb->hash_shift, sizeof(*tlb->hash));
+	}
+
+	for (unsigned int i = 0; i < sets; i++) {
+		struct tlb_set *set = tlb->sets + i;
+
+		INIT_LIST_HEAD(&set->free);
+		INIT_LIST_HEAD(&set->order);
+
+		if (tlb_policy->fill == __lfu_fill) {
+			set->freqs = malloc(sizeof(*set->freqs) * (TLB_LFU_MAX_FREQ + 1));
+			for (int f = 0; f <= TLB_LFU_MAX_FREQ; f++) {
+				INIT_LIST_HEAD(set->freqs + f);
+			}
+		}
+
+		for (unsigned int j = 0; j < ways; j++) {
+			struct tlb_entry *t = tlb->entries + i * ways + j;
+
+			INIT_LIST_HEAD(&t->list);
+			INIT_LIST_HEAD(&t->asid_list);
+			list_add_tail(&t->set_list, &set->free);
+		}
+	}
+
+	tlbs[nr_tlb_levels++] = tlb;
+	return true;
+}
+
+struct tlb_entry *probe_tlb(unsigned int asid, unsigned long vpn)
+{
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		struct tlb *tlb = tlbs[i];
+		struct tlb_entry *t = __find_tlb(tlb, asid, vpn);
+		unsigned long key = vpn;
+
+		if (!t && tlb->nr_huge) {
+			key = TLB_HUGE_KEY(vpn);
+			t = __find_tlb(tlb, asid, key);
+		}
+
+		if (!t) {
+			tlb->stat.misses++;
+			continue;
+		}
+
+		tlb->stat.hits++;
+		if (t->huge) tlb->stat.huge_hits++;
+		if (t->prefetched) {
+			t->prefetched = false;
+			tlb->stat.prefetch_hits++;
+		}
+		tlb_policy->touch(tlb, __tlb_set(tlb, t), t);
+
+		/* Refill the upper levels that missed on the way */
+		while (--i >= 0) {
+			t = __fill_tlb(tlbs[i], asid, key, t->pfn, t->writable, t->cow);
+		}
+		return t;
+	}
+	return NULL;
+}
+
+void fill_tlb(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow)
+{
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		__fill_tlb(tlbs[i], asid, vpn, pfn, writable, cow);
+	}
+}
+
+void fill_tlb_huge(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow)
+{
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		__fill_tlb(tlbs[i], asid, TLB_HUGE_KEY(vpn), pfn, writable, cow);
+	}
+}
+
+bool prefetch_tlb(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow)
+{
+	struct tlb *tlb = tlbs[nr_tlb_levels - 1];
+	struct tlb_entry *t;
+
+	if (__find_tlb(tlb, asid, vpn)) return false;
+
+	t = __fill_tlb(tlb, asid, vpn, pfn, writable, cow);
+	t->prefetched = true;
+	tlb->stat.prefetches++;
+	return true;
+}
+
+/**
+ * Demote the superpage of @asid covering @vpn in @tlb, if any. The pages
+ * are cached again one by one as they are accessed.
+ */
+static void __invalidate_tlb_huge(struct tlb *tlb, unsigned int asid, unsigned long vpn)
+{
+	struct tlb_entry *t;
+
+	if (!tlb->nr_huge) return;
+
+	t = __find_tlb(tlb, asid, TLB_HUGE_KEY(vpn));
+	if (t) __invalidate_tlb_entry(tlb, t);
+}
+
+void update_tlb(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow)
+{
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		struct tlb_entry *t = __find_tlb(tlbs[i], asid, vpn);
+
+		__invalidate_tlb_huge(tlbs[i], asid, vpn);
+		if (!t) continue;
+
+		t->pfn = pfn;
+		t->writable = writable;
+		t->cow = cow;
+	}
+}
+
+void invalidate_tlb(unsigned int asid, unsigned long vpn)
+{
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		struct tlb *tlb = tlbs[i];
+		struct tlb_entry *t = __find_tlb(tlb, asid, vpn);
+
+		if (t) __invalidate_tlb_entry(tlb, t);
+		__invalidate_tlb_huge(tlb, asid, vpn);
+	}
+}
+
+void invalidate_tlb_range(unsigned int asid, unsigned long vpn, unsigned long nr_pages)
+{
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		struct tlb *tlb = tlbs[i];
+		struct tlb_entry *t, *tmp;
+
+		/* Probing costs O(@nr_pages) while walking costs O(ways in total) */
+		if (nr_pages <= tlb->nr_sets * tlb->nr_ways) {
+			for (unsigned long v = vpn; v < vpn + nr_pages; v++) {
+				t = __find_tlb(tlb, asid, v);
+				if (t) __invalidate_tlb_entry(tlb, t);
+				if (v == vpn || v % NR_PTES_PER_PAGE == 0) {
+					__invalidate_tlb_huge(tlb, asid, v);
+				}
+			}
+			continue;
+		}
+
+		list_for_each_entry_safe(t, tmp, tlb->asid_entries + asid, asid_list) {
+			unsigned long v = tlb_entry_vpn(tlb, t);
+			unsigned long nr = t->huge ? NR_PTES_PER_PAGE : 1;
+
+			/* Drop the entry if [v, v + nr) overlaps the range */
+			if (v < vpn + nr_pages && vpn < v + nr) {
+				__invalidate_tlb_entry(tlb, t);
+			}
+		}
+	}
+}
+
+void protect_tlb(unsigned int asid)
+{
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		struct tlb_entry *t;
+
+		list_for_each_entry(t, tlbs[i]->asid_entries + asid, asid_list) {
+			if (!t->writable) continue;
+
+			t->writable = false;
+			t->cow = true;
+		}
+	}
+}
+
+void flush_tlb(void)
+{
+	/* Entries of older generations are ignored and swept out lazily */
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		tlbs[i]->gen++;
+		tlbs[i]->stat.flushes++;
+	}
+}
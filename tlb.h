@@ -0,0 +1,275 @@
+/**********************************************************************
+ * Copyright (c) 2020-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <stdint.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+
+/**
+ * TLB access statistics of a TLB level. @probes counts the compare steps
+ * taken while looking up this level; an entry compared in the hash index,
+ * or a vector of keys compared at once when scanning a set. Of the
+ * @prefetches, @prefetch_hits were hit later, and @prefetch_unused were
+ * evicted before being hit.
+ */
+struct tlb_stat {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long fills;
+	unsigned long evictions;
+	unsigned long flushes;
+	unsigned long probes;
+	unsigned long huge_hits;
+	unsigned long prefetches;
+	unsigned long prefetch_hits;
+	unsigned long prefetch_unused;
+};
+
+/**
+ * A level of the TLB hierarchy. It is made of @nr_sets sets of @nr_ways
+ * entries each, and a VPN can be cached only in the set of
+ * (vpn % nr_sets). Looking up the level takes @latency cycles.
+ *
+ * The fields a lookup compares are kept as arrays indexed in the same way
+ * as @entries. The ASIDs and VPNs of a set are folded into 32-bit keys and
+ * packed in @keys so that 4 to 16 of them can be matched at once with SIMD
+ * instructions, and @valid has a bit for each way, padded to @valid_words
+ * words per set. @entries keeps the rest which is needed only once the
+ * entry is found. Sets wider than TLB_SCAN_MAX_WAYS are not scanned but
+ * indexed by @hash.
+ *
+ * Each entry records in @gens the generation of the TLB it was filled at.
+ * Flushing the TLB just advances @gen, which makes all the entries of
+ * older generations stale; they never match on lookups and are reclaimed
+ * set by set on the next fill.
+ *
+ * A superpage entry maps all NR_PTES_PER_PAGE pages of a page directory.
+ * It shares the sets with the base page entries, keyed by TLB_HUGE_KEY()
+ * of its VPNs. @nr_huge counts the superpage entries filled so far, and
+ * lookups probe for superpages only when there may be some.
+ */
+struct tlb_set;
+
+struct tlb {
+	const char *name;
+	unsigned int nr_sets;
+	unsigned int nr_ways;
+	unsigned int latency;
+
+	struct tlb_entry *entries;	/* Laid out set by set */
+	struct tlb_set *sets;
+
+	unsigned long *vpns;
+	uint32_t *keys;
+	unsigned short *asids;
+	unsigned long *gens;
+	unsigned long *valid;
+	unsigned int valid_words;
+
+	struct hlist_head *hash;	/* Index keyed by (ASID, VPN) */
+	unsigned int hash_shift;
+
+	unsigned long gen;
+	unsigned int nr_huge;
+
+	struct list_head fifo;		/* Valid entries in the inserted order */
+	struct list_head asid_entries[NR_ASIDS];	/* Valid entries of each ASID */
+
+	struct tlb_stat stat;
+};
+
+/**
+ * TLB levels from the closest one to the core. With a single level, it works
+ * as the only TLB of the system. With two levels, tlbs[0] is a small L1 TLB
+ * and tlbs[1] is the unified L2 TLB backing it.
+ */
+#define NR_TLB_LEVELS	2
+extern struct tlb *tlbs[NR_TLB_LEVELS];
+extern unsigned int nr_tlb_levels;
+
+/* Lookup latencies of the TLB levels in cycles */
+#define L1_TLB_LATENCY	1
+#define L2_TLB_LATENCY	7
+
+/* The key of the superpage entry covering @vpn. Never collides with VPNs */
+#define TLB_HUGE_KEY(vpn)	((1UL << (BITS_PER_LONG - 1)) | ((vpn) >> pt_shift))
+
+/**
+ * The first VPN that @t of @tlb translates
+ */
+static inline unsigned long tlb_entry_vpn(struct tlb *tlb, struct tlb_entry *t)
+{
+	unsigned long vpn = tlb->vpns[t - tlb->entries];
+
+	return t->huge ? (vpn & ~TLB_HUGE_KEY(0)) << pt_shift : vpn;
+}
+
+/**
+ * Whether @t of @tlb holds a translation that is not flushed yet
+ */
+static inline bool tlb_entry_valid(struct tlb *tlb, struct tlb_entry *t)
+{
+	return tlb->gens[t - tlb->entries] == tlb->gen;
+}
+
+
+/***********************************************************************
+ * set_tlb_policy()
+ *
+ * DESCRIPTION
+ *   Choose the replacement policy of the TLB by @name, which is one of
+ *   "fifo" (default), "lru", "clock", "random", and "lfu". The policy is
+ *   applied to all TLB levels. Should be called before init_tlb().
+ *
+ * RETURN VALUE
+ *   Return true on success, false if there is no such policy.
+ */
+bool set_tlb_policy(const char *name);
+
+/***********************************************************************
+ * tlb_policy_name()
+ *
+ * RETURN VALUE
+ *   Return the name of the current TLB replacement policy.
+ */
+const char *tlb_policy_name(void);
+
+/***********************************************************************
+ * tlb_matcher_name()
+ *
+ * RETURN VALUE
+ *   Return the name of the key matcher chosen for the CPU; "avx512", "avx2",
+ *   "sse2", or "scalar".
+ */
+const char *tlb_matcher_name(void);
+
+/***********************************************************************
+ * init_tlb()
+ *
+ * DESCRIPTION
+ *   Add a TLB level named @name with @sets sets of @ways entries below the
+ *   levels added so far. @sets should be a power of two.
+ *
+ * RETURN VALUE
+ *   Return true on success, false if the geometry is not valid or there are
+ *   already NR_TLB_LEVELS levels.
+ */
+bool init_tlb(const char *name, unsigned int sets, unsigned int ways, unsigned int latency);
+
+/***********************************************************************
+ * probe_tlb()
+ *
+ * DESCRIPTION
+ *   Look up the translation of @vpn of the address space @asid through the
+ *   TLB levels in order. Each level is searched for the base page first and
+ *   then for the superpage covering @vpn. A hit in a lower level refills the
+ *   upper levels that missed. Hits and misses are accounted to each level
+ *   probed.
+ *
+ * RETURN VALUE
+ *   Return the TLB entry in the upper-most level, or NULL on the TLB miss.
+ *   The PFN of @vpn is @pfn + (@vpn % NR_PTES_PER_PAGE) if the entry is
+ *   @huge.
+ */
+struct tlb_entry *probe_tlb(unsigned int asid, unsigned long vpn);
+
+/***********************************************************************
+ * fill_tlb()
+ *
+ * DESCRIPTION
+ *   Cache the translation from @vpn to @pfn of @asid in every TLB level
+ *   along with its permission. @writable tells whether writes can be served
+ *   from the entry, and @cow marks the page write-protected for
+ *   copy-on-write. An entry chosen by the replacement policy is evicted
+ *   when the set of @vpn is full.
+ */
+void fill_tlb(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow);
+
+/***********************************************************************
+ * fill_tlb_huge()
+ *
+ * DESCRIPTION
+ *   Cache the superpage of @asid that covers @vpn in every TLB level. @pfn
+ *   is the first page frame of the superpage, and the permission applies
+ *   to all pages in it.
+ */
+void fill_tlb_huge(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow);
+
+/***********************************************************************
+ * prefetch_tlb()
+ *
+ * DESCRIPTION
+ *   Cache the translation from @vpn to @pfn of @asid ahead of its use. It
+ *   goes to the last TLB level only, through the replacement policy as
+ *   filled on demand, and is skipped if the level caches @vpn already.
+ *
+ * RETURN VALUE
+ *   Return true if the translation is prefetched, false otherwise.
+ */
+bool prefetch_tlb(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow);
+
+/***********************************************************************
+ * update_tlb()
+ *
+ * DESCRIPTION
+ *   Update the cached translation of @vpn of @asid in place, if any, after
+ *   its PTE is changed. Not cached translations are left uncached. The
+ *   superpage covering @vpn is dropped as it cannot map @pfn anymore.
+ */
+void update_tlb(unsigned int asid, unsigned long vpn, unsigned int pfn, bool writable, bool cow);
+
+/***********************************************************************
+ * invalidate_tlb()
+ *
+ * DESCRIPTION
+ *   Drop the translation of @vpn of @asid from all TLB levels, including
+ *   the superpage covering @vpn.
+ */
+void invalidate_tlb(unsigned int asid, unsigned long vpn);
+
+/***********************************************************************
+ * invalidate_tlb_range()
+ *
+ * DESCRIPTION
+ *   Drop the translations of @nr_pages pages from @vpn of @asid from all TLB
+ *   levels. Probes the hash index page by page or walks the entries of
+ *   @asid, whichever is cheaper.
+ */
+void invalidate_tlb_range(unsigned int asid, unsigned long vpn, unsigned long nr_pages);
+
+/***********************************************************************
+ * protect_tlb()
+ *
+ * DESCRIPTION
+ *   Write-protect all writable translations of @asid cached in the TLB for
+ *   copy-on-write. Read-only translations stay as they are.
+ */
+void protect_tlb(unsigned int asid);
+
+/***********************************************************************
+ * flush_tlb()
+ *
+ * DESCRIPTION
+ *   Drop all translations from all TLB levels. This only advances the TLB
+ *   generations, so it takes O(1) regardless of the size of the TLB.
+ */
+void flush_tlb(void);
+
+#endif
@@ -20,4 +20,6 @@ typedef unsigned char bool;
 #define true	1
 #define false	0
 
+#define BITS_PER_LONG	(sizeof(unsigned long) * 8)
+
 #endif
@@ -27,19 +27,58 @@
 
 #include "list_head.h"
 #include "vm.h"
+#include "pagetable.h"
+#include "tlb.h"
+#include "pwc.h"
+#include "frame.h"
+#include "swap.h"
+#include "reclaim.h"
+#include "oracle.h"
 
 static bool verbose = true;
 
 static bool print_tlb_result = false;
 
+static unsigned int tlb_sets = 1;
+static unsigned int tlb_ways = NR_TLB_ENTRIES;
+static unsigned int l1_tlb_sets = 0;	/* No L1 TLB unless specified */
+static unsigned int l1_tlb_ways = 0;
+static unsigned int pwc_entries = NR_PWC_ENTRIES;
+
+/**
+ * TLB prefetchers triggered by page walks. They prefetch only the PTEs in
+ * the page directory of the walk, which the MMU has at hand;
+ *   - PREFETCH_NEXT prefetches the next page
+ *   - PREFETCH_STRIDE prefetches the page a stride ahead once the walks
+ *     follow a constant stride
+ *   - PREFETCH_DIR prefetches all valid pages in the page directory
+ */
+enum {
+	PREFETCH_NONE,
+	PREFETCH_NEXT,
+	PREFETCH_STRIDE,
+	PREFETCH_DIR,
+};
+static const char * const prefetcher_names[] = {
+	[PREFETCH_NONE] = "none",
+	[PREFETCH_NEXT] = "next",
+	[PREFETCH_STRIDE] = "stride",
+	[PREFETCH_DIR] = "dir",
+};
+static unsigned int prefetcher = PREFETCH_NONE;
+
 /**
  * Initial process
  */
 static struct process init = {
 	.pid = 0,
+	.asid = 0,
+	.asid_gen = 0,
 	.list = LIST_HEAD_INIT(init.list),
 	.pagetable = {
-		.outer_ptes = { NULL },
+		.outer_ptes = NULL,
+		.id = 0,
+		.pds = LIST_HEAD_INIT(init.pagetable.pds),
 	},
 };
 
@@ -60,24 +99,85 @@ LIST_HEAD(processes);
 struct pagetable *ptbr = NULL;
 
 /**
- * Map count for each page frame
+ * Map count for each page frame. Allocated for @nr_pageframes frames at
+ * startup
  */
-unsigned int mapcounts[NR_PAGEFRAMES] = { 0 };
+unsigned int *mapcounts = NULL;
+static unsigned int nr_pageframes = NR_PAGEFRAMES;
+static unsigned long page_size = PAGE_SIZE;
 
 /**
- * TLB of the system
+ * Whether TLB caches the page directories mapping superpages with single
+ * entries
  */
-struct tlb_entry tlb[NR_TLB_ENTRIES] = {
-	{false, 0, 0},
-};
+bool superpages = false;
 
-extern unsigned int alloc_page(unsigned int vpn, unsigned int rw);
-extern void free_page(unsigned int vpn);
-extern bool handle_page_fault(unsigned int vpn, unsigned int rw);
+/**
+ * MMU sets the accessed bit of a PTE when it walks to the PTE, as x86 does.
+ * So the accessed bits of the pages hit in TLB stay clear until their TLB
+ * entries are evicted. With @accessed_on_hit, TLB hits set the accessed bit
+ * as well, which is precise but costs a PTE update for every access.
+ */
+static bool accessed_on_hit = false;
+
+extern unsigned int alloc_page(unsigned long vpn, unsigned int rw);
+extern unsigned int alloc_pages(unsigned long vpn, unsigned int nr_pages, unsigned int rw);
+extern void free_page(unsigned long vpn);
+extern bool handle_page_fault(unsigned long vpn, unsigned int rw);
 extern void switch_process(unsigned int pid);
 
-extern bool lookup_tlb(unsigned int vpn, unsigned int *pfn);
-extern void insert_tlb(unsigned int vpn, unsigned int pfn);
+extern bool lookup_tlb(unsigned long vpn, unsigned int *pfn, bool *writable);
+extern void insert_tlb(unsigned long vpn, struct pte *pte);
+extern void prefetch_tlb_pte(unsigned long vpn, struct pte *pte);
+
+/**
+ * Prefetch the translations around @vpn from @pd, which the page walk for
+ * @vpn has just read
+ */
+static void __prefetch_tlb(unsigned long vpn, struct pte_directory *pd)
+{
+	static unsigned long last_vpn = 0;
+	static long last_stride = 0;
+	unsigned long base = vpn - vpn % NR_PTES_PER_PAGE;
+	long stride = (long)vpn - (long)last_vpn;
+	unsigned long target;
+
+	last_vpn = vpn;
+
+	/* The superpage entry covers the whole directory already */
+	if (superpages && pd->huge) return;
+
+	switch (prefetcher) {
+	case PREFETCH_NEXT:
+		stride = 1;
+		break;
+	case PREFETCH_STRIDE:
+		/**
+		 * The page prefetched by the last walk is hit without walking, so
+		 * the next walk comes two strides apart while the stride holds
+		 */
+		if (stride == 0 || (stride != last_stride && stride != last_stride * 2)) {
+			last_stride = stride;
+			return;
+		}
+		stride = last_stride;
+		break;
+	case PREFETCH_DIR:
+		for (unsigned long i = 0; i < NR_PTES_PER_PAGE; i++) {
+			if (base + i == vpn || !pte_valid(&pd->ptes[i])) continue;
+			prefetch_tlb_pte(base + i, pd->ptes + i);
+		}
+		return;
+	default:
+		return;
+	}
+
+	target = vpn + stride;
+	if (target < base || target >= base + NR_PTES_PER_PAGE) return;
+	if (!pte_valid(&pd->ptes[target - base])) return;
+
+	prefetch_tlb_pte(target, pd->ptes + (target - base));
+}
 
 /**
  * __translate()
@@ -86,51 +186,97 @@ extern void insert_tlb(unsigned int vpn, unsigned int pfn);
  *   This function simulates the address translation in MMU.
  *   It translates @vpn to @pfn using the page table pointed by @ptbr.
  *
+ *   The TLB caches the permission of the translation as well. A write to a
+ *   page cached as read-only walks the page table; if the PTE is writable,
+ *   the walk sets the dirty and accessed bits and upgrades the cached entry
+ *   to writable. Otherwise the write faults.
+ *
  * RETURN
  *   @true on successful translation
  *   @false if unable to translate. This includes the case when the page access
  *   is for write (indicated in @rw), but the @writable of the pte is @false.
  */
-static bool __translate(unsigned int rw, unsigned int vpn, unsigned int *pfn, bool *from_tlb)
+static bool __translate(unsigned int rw, unsigned long vpn, unsigned int *pfn, bool *from_tlb)
 {
-	int pd_index = vpn / NR_PTES_PER_PAGE;
-	int pte_index = vpn % NR_PTES_PER_PAGE;
+	unsigned long pd_index = vpn / NR_PTES_PER_PAGE;
+	unsigned long pte_index = vpn % NR_PTES_PER_PAGE;
 
 	struct pagetable *pt = ptbr;
 	struct pte_directory *pd;
 	struct pte *pte;
+	unsigned int nr_levels = 0;
+	bool writable;
 
 	/* Lookup the mapping from TLB */
-	if (print_tlb_result && lookup_tlb(vpn, pfn)) {
+	if (print_tlb_result && lookup_tlb(vpn, pfn, &writable)) {
 		*from_tlb = true;
-		return true;
-	}
 
-	/* Nah, TLB miss */
-	*from_tlb = false;
+		if (rw != RW_WRITE || writable) {
+			if (accessed_on_hit) {
+				pte = lookup_pte(pt, vpn);
+				pte_set(pte, PTE_ACCESSED | (rw == RW_WRITE ? PTE_DIRTY : 0));
+			}
+			return true;
+		}
+
+		/**
+		 * The translation is cached as read-only. Walk the page table to
+		 * set the dirty bit if the page is writable, or to confirm the
+		 * permission fault otherwise.
+		 */
+	} else {
+		/* Nah, TLB miss */
+		*from_tlb = false;
+	}
 
 	/* Page table is invalid */
 	if (!pt) return false;
 
-	pd = pt->outer_ptes[pd_index];
+	walk_stat.walks++;
 
-	/* Page directory does not exist */
-	if (!pd) return false;
+	/* The upper levels can be skipped if the page-walk cache has the directory */
+	pd = lookup_pwc(current->asid, pd_index);
+	if (!pd) {
+		pd = lookup_pd(pt, vpn, &nr_levels);
+		walk_stat.refs += nr_levels;
 
+		/* Long hash chains and probes are counted together at the last */
+		if (nr_levels >= MAX_PT_LEVELS) nr_levels = MAX_PT_LEVELS - 1;
+
+		/* Page directory does not exist */
+		if (!pd) {
+			walk_stat.touched[nr_levels]++;
+			return false;
+		}
+
+		fill_pwc(current->asid, pd_index, pd);
+	}
+
+	walk_stat.refs++;
+	walk_stat.touched[nr_levels + 1]++;
 	pte = &pd->ptes[pte_index];
 
 	/* PTE is invalid */
-	if (!pte->valid) return false;
+	if (!pte_valid(pte)) return false;
 
-	/* Unable to handle the write access */
+	/* Unable to handle the write access. Shared directories are read-only */
 	if (rw == RW_WRITE) {
-		if (!pte->writable) return false;
+		if (!pte_writable(pte) || pd_shared(pd)) return false;
+		pte_set(pte, PTE_DIRTY);
+	}
+	pte_set(pte, PTE_ACCESSED);
+	*pfn = pte_pfn(pte);
+
+	/* Writes can be served from the cached translation from now on */
+	if (*from_tlb) {
+		update_tlb(current->asid, vpn, *pfn, true, false);
+		return true;
 	}
-	*pfn = pte->pfn;
 
 	/* Insert the mapping into TLB */
 	if (print_tlb_result) {
-		insert_tlb(vpn, *pfn);
+		insert_tlb(vpn, pte);
+		__prefetch_tlb(vpn, pd);
 	}
 
 	return true;
@@ -147,7 +293,7 @@ static bool __translate(unsigned int rw, unsigned int vpn, unsigned int *pfn, bo
  *   @true on successful access
  *   @false if unable to access @vpn for @rw
  */
-static bool __access_memory(unsigned int vpn, unsigned int rw)
+static bool __access_memory(unsigned long vpn, unsigned int rw)
 {
 	unsigned int pfn;
 	int ret;
@@ -157,11 +303,12 @@ static bool __access_memory(unsigned int vpn, unsigned int rw)
 	assert((rw & RW_READ) ^ (rw & RW_WRITE));
 
 	/**
-	 * We have NR_PTES_PER_PAGE entries in the outer table and so do for
-	 * inner page table. Thus each process can have up to NR_PTES_PER_PAGE^2
-	 * as its VPN
+	 * We have NR_PTES_PER_PAGE entries in each of the @pt_levels levels of
+	 * the page table. Thus each process can have up to NR_VPNS as its VPN
 	 */
-	assert(vpn < NR_PTES_PER_PAGE * NR_PTES_PER_PAGE);
+	assert(vpn < NR_VPNS);
+
+	reclaim_tick();
 
 	do {
 		bool from_tlb;
@@ -171,7 +318,7 @@ static bool __access_memory(unsigned int vpn, unsigned int rw)
 			if (print_tlb_result) {
 				fprintf(stderr, "%c |", from_tlb ? 'o' : 'x');
 			}
-			fprintf(stderr, " %3u --> %-3u\n", vpn, pfn);
+			fprintf(stderr, " %3lu --> %-3u\n", vpn, pfn);
 			return true;
 		}
 
@@ -181,15 +328,56 @@ static bool __access_memory(unsigned int vpn, unsigned int rw)
 		 * Count the number of retries to prevent buggy translation.
 		 */
 		nr_retries++;
+		reclaim_stat.faults++;
 	} while ((ret = handle_page_fault(vpn, rw)) == true && nr_retries < 2);
 
 	if (ret == false) {
-		fprintf(stderr, "Unable to access %u\n", vpn);
+		fprintf(stderr, "Unable to access %lu\n", vpn);
 	}
 
 	return ret;
 }
 
+/**
+ * Parse @str of a size with an optional K, M, G, or T suffix into @size.
+ * The size may end with B, as in 16KB or 4096B.
+ * Return false if @str is not a size.
+ */
+static bool __parse_size(const char *str, unsigned long long *size)
+{
+	char *end;
+	unsigned long long value = strtoull(str, &end, 0);
+
+	if (end == str) return false;
+
+	/* Each suffix falls through to the smaller ones */
+	switch (toupper(*end)) {
+	case 'T':
+		value <<= 10;
+		/* fall through */
+	case 'G':
+		value <<= 10;
+		/* fall through */
+	case 'M':
+		value <<= 10;
+		/* fall through */
+	case 'K':
+		value <<= 10;
+		end++;
+		break;
+	case 'B':
+	case '\0':
+		break;
+	default:
+		return false;
+	}
+	if (toupper(*end) == 'B') end++;
+	if (*end) return false;
+
+	*size = value;
+	return true;
+}
+
 static unsigned int __make_rwflag(const char *rw)
 {
 	int len = strlen(rw);
@@ -206,15 +394,35 @@ static unsigned int __make_rwflag(const char *rw)
 	return rwflag;
 }
 
-static bool __alloc_page(unsigned int vpn, unsigned int rw)
+/**
+ * Whether @vpn of the current process is swapped out. MMU cannot translate
+ * it, but it is still allocated.
+ */
+static bool __swapped(unsigned long vpn)
+{
+	struct pte *pte = lookup_pte(ptbr, vpn);
+
+	return pte && pte_swapped(pte);
+}
+
+static bool __alloc_page(unsigned long vpn, unsigned int rw)
 {
 	unsigned int pfn;
 	bool from_tlb;
 
 	assert(rw);
 
+	if (vpn >= NR_VPNS) {
+		fprintf(stderr, "Cannot map 1 pages from %lu\n", vpn);
+		return false;
+	}
+
 	if (__translate(RW_READ, vpn, &pfn, &from_tlb)) {
-		fprintf(stderr, "%u is already allocated to %u\n", vpn, pfn);
+		fprintf(stderr, "%lu is already allocated to %u\n", vpn, pfn);
+		return false;
+	}
+	if (__swapped(vpn)) {
+		fprintf(stderr, "%lu is already allocated and swapped out\n", vpn);
 		return false;
 	}
 
@@ -223,21 +431,62 @@ static bool __alloc_page(unsigned int vpn, unsigned int rw)
 		fprintf(stderr, "memory is full\n");
 		return false;
 	}
-	fprintf(stderr, "alloc %3u --> %-3u\n", vpn, pfn);
+	fprintf(stderr, "alloc %3lu --> %-3u\n", vpn, pfn);
 	
 	return true;
 }
 
-static bool __free_page(unsigned int vpn)
+static bool __alloc_pages(unsigned long vpn, unsigned int rw, unsigned int nr_pages)
+{
+	unsigned int pfn;
+	bool from_tlb;
+
+	assert(rw);
+
+	if (!nr_pages || vpn + nr_pages > NR_VPNS) {
+		fprintf(stderr, "Cannot map %u pages from %lu\n", nr_pages, vpn);
+		return false;
+	}
+	if (nr_pages > (1U << FRAME_MAX_ORDER)) {
+		fprintf(stderr, "Cannot allocate more than %u contiguous page frames\n",
+				1U << FRAME_MAX_ORDER);
+		return false;
+	}
+
+	for (unsigned int i = 0; i < nr_pages; i++) {
+		if (__translate(RW_READ, vpn + i, &pfn, &from_tlb) || __swapped(vpn + i)) {
+			fprintf(stderr, "%lu is already allocated\n", vpn + i);
+			return false;
+		}
+	}
+
+	pfn = alloc_pages(vpn, nr_pages, rw);
+	if (pfn == -1) {
+		fprintf(stderr, "no %u contiguous page frames\n", nr_pages);
+		return false;
+	}
+	for (unsigned int i = 0; i < nr_pages; i++) {
+		fprintf(stderr, "alloc %3lu --> %-3u\n", vpn + i, pfn + i);
+	}
+
+	return true;
+}
+
+static bool __free_page(unsigned long vpn)
 {
 	unsigned int pfn;
 	bool from_tlb;
 
 	if (!__translate(RW_READ, vpn, &pfn, &from_tlb)) {
-		fprintf(stderr, "%u is not allocated\n", vpn);
+		if (__swapped(vpn)) {
+			fprintf(stderr, "free %lu (swapped)\n", vpn);
+			free_page(vpn);
+			return true;
+		}
+		fprintf(stderr, "%lu is not allocated\n", vpn);
 		return false;
 	}
-	fprintf(stderr, "free %u (pfn %u)\n", vpn, pfn);
+	fprintf(stderr, "free %lu (pfn %u)\n", vpn, pfn);
 	free_page(vpn);
 
 	return true;
@@ -246,34 +495,129 @@ static bool __free_page(unsigned int vpn)
 static void __init_system(void)
 {
 	ptbr = &init.pagetable;
+
+	if (l1_tlb_sets) {
+		init_tlb("L1 TLB", l1_tlb_sets, l1_tlb_ways, L1_TLB_LATENCY);
+		init_tlb("L2 TLB", tlb_sets, tlb_ways, L2_TLB_LATENCY);
+	} else {
+		init_tlb("TLB", tlb_sets, tlb_ways, L1_TLB_LATENCY);
+	}
+
+	init_pwc(pwc_entries);
+	mapcounts = calloc(nr_pageframes, sizeof(*mapcounts));
+	init_frames(nr_pageframes);
+	init_reclaim(nr_pageframes);
 }
 
+static void __count_mappings(struct process *p, unsigned int *nr_mappings)
+{
+	struct pte_directory *pd;
+	unsigned long base;
+
+	for (base = 0; (pd = next_pd(&p->pagetable, &base)); base += NR_PTES_PER_PAGE) {
+		for (unsigned long j = 0; j < NR_PTES_PER_PAGE; j++) {
+			if (pte_valid(&pd->ptes[j])) nr_mappings[pte_pfn(&pd->ptes[j])]++;
+		}
+	}
+}
+
+/**
+ * Show the number of PTEs mapping each page frame over all processes. This
+ * differs from @mapcounts, which counts a page directory shared since fork
+ * once.
+ */
 static void __show_pageframes(void)
 {
-	for (unsigned int i = 0; i < NR_PAGEFRAMES; i++) {
+	unsigned int *nr_mappings = calloc(nr_pageframes, sizeof(*nr_mappings));
+	struct process *p;
+
+	__count_mappings(current, nr_mappings);
+	list_for_each_entry(p, &processes, list) {
+		__count_mappings(p, nr_mappings);
+	}
+
+	for (unsigned int i = 0; i < nr_pageframes; i++) {
 		if (!mapcounts[i]) continue;
-		fprintf(stderr, "%3u: %d\n", i, mapcounts[i]);
+		fprintf(stderr, "%3u: %d\n", i, nr_mappings[i]);
 	}
 	fprintf(stderr, "\n");
+	free(nr_mappings);
 }
 
-static void __show_pagetable(void)
+/**
+ * Show the free blocks of each order. The unusable index of an order is the
+ * fraction of the free page frames that cannot serve an allocation of that
+ * order as they are in smaller blocks.
+ */
+static void __show_buddyinfo(void)
 {
-	fprintf(stderr, "\n*** PID %u ***\n", current->pid);
+	unsigned long nr_free = 0;
+	unsigned long nr_usable;
+
+	for (unsigned int order = 0; order <= FRAME_MAX_ORDER; order++) {
+		nr_free += nr_free_blocks(order) << order;
+	}
+	nr_usable = nr_free;
+
+	fprintf(stderr, "order  blocks  unusable\n");
+	for (unsigned int order = 0; order <= FRAME_MAX_ORDER; order++) {
+		if ((1UL << order) > nr_pageframes) break;
+
+		fprintf(stderr, "%5u  %6lu  %7.2f%%\n", order, nr_free_blocks(order),
+				nr_free ? (nr_free - nr_usable) * 100.0 / nr_free : 0.0);
+		nr_usable -= nr_free_blocks(order) << order;
+	}
+	fprintf(stderr, "free frames: %lu / %u\n", nr_free, nr_pageframes);
+}
+
+/**
+ * Show the accessed and dirty bits of the pages of the current process, and
+ * clear the accessed bits. The cached translations of the pages are dropped
+ * so that MMU walks to the PTEs and sets the bits again on the next accesses.
+ * The dirty bits are kept as they tell the pages to be written to swap.
+ */
+static void __scan_pagetable(void)
+{
+	struct pte_directory *pd;
+	unsigned long base;
+
+	for (base = 0; (pd = next_pd(ptbr, &base)); base += NR_PTES_PER_PAGE) {
+		for (unsigned long j = 0; j < NR_PTES_PER_PAGE; j++) {
+			struct pte *pte = &pd->ptes[j];
+			unsigned long vpn = base + j;
+
+			if (!pte_valid(pte)) continue;
 
-	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
-		struct pte_directory *pd = current->pagetable.outer_ptes[i];
+			fprintf(stderr, "%3lu: %c%c\n", vpn,
+					pte_accessed(pte) ? 'a' : '-', pte_dirty(pte) ? 'd' : '-');
 
-		if (!pd) continue;
+			if (pte_accessed(pte)) invalidate_tlb(current->asid, vpn);
+			pte_clear(pte, PTE_ACCESSED);
+		}
+	}
+}
 
-		for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
+static void __show_pagetable(void)
+{
+	struct pte_directory *pd;
+	unsigned long base;
+
+	fprintf(stderr, "\n*** PID %u ***\n", current->pid);
+
+	for (base = 0; (pd = next_pd(&current->pagetable, &base)); base += NR_PTES_PER_PAGE) {
+		for (unsigned long j = 0; j < NR_PTES_PER_PAGE; j++) {
 			struct pte *pte = &pd->ptes[j];
 
-			if (!verbose && !pte->valid) continue;
-			fprintf(stderr, "%02d:%02d %c%c | %-3d\n", i, j,
-				pte->valid ? 'v' : ' ',
-				pte->writable ? 'w' : ' ',
-				pte->pfn);
+			if (!verbose && pte_none(pte)) continue;
+
+			/* Index to the table of each level, from the top */
+			for (int level = pt_levels - 1; level > 0; level--) {
+				fprintf(stderr, "%02lu:", (base >> (level * pt_shift)) % NR_PTES_PER_PAGE);
+			}
+			fprintf(stderr, "%02lu %c%c | %-3d\n", j,
+				pte_valid(pte) ? 'v' : pte_swapped(pte) ? 's' : ' ',
+				pte_writable(pte) && !pd_shared(pd) ? 'w' : ' ',
+				pte_pfn(pte));
 		}
 		printf("\n");
 	}
@@ -281,12 +625,161 @@ static void __show_pagetable(void)
 
 static void __show_tlb(void)
 {
-	for (int i = 0; i < sizeof(tlb) / sizeof(*tlb); i++) {
-		struct tlb_entry *t = tlb + i;
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		struct tlb_entry *t;
+
+		if (nr_tlb_levels > 1) fprintf(stderr, "%s\n", tlbs[i]->name);
+
+		list_for_each_entry(t, &tlbs[i]->fifo, list) {
+			unsigned int index = t - tlbs[i]->entries;
+
+			if (!tlb_entry_valid(tlbs[i], t)) continue;
+			if (tlbs[i]->asids[index] != current->asid) continue;
+
+			if (t->huge) {
+				fprintf(stderr, "%3lu -> %-3d x%lu\n", tlb_entry_vpn(tlbs[i], t),
+						t->pfn, NR_PTES_PER_PAGE);
+				continue;
+			}
+			fprintf(stderr, "%3lu -> %-3d\n", tlbs[i]->vpns[index], t->pfn);
+		}
+	}
+}
+
+/**
+ * Show the number of tables at each level of the page tables of all
+ * processes, or the page directories and hash buckets of the hashed page
+ * tables, and the memory they take
+ */
+static void __show_pagetable_usage(void)
+{
+	unsigned long nr_tables[MAX_PT_LEVELS] = { 0 };
+	unsigned long nr_bytes = 0;
+	struct process *p;
+
+	count_pagetable(&current->pagetable, nr_tables);
+	list_for_each_entry(p, &processes, list) {
+		count_pagetable(&p->pagetable, nr_tables);
+	}
 
-		if (!t->valid) continue;
+	if (pt_hashed()) {
+		fprintf(stderr, "Page table (%s, %lu PTEs per directory)\n", pt_backend_name(),
+				NR_PTES_PER_PAGE);
+		nr_bytes = nr_tables[pt_levels - 1] * pt_table_size(pt_levels - 1);
+		fprintf(stderr, "  dirs      : %lu (%lu bytes)\n", nr_tables[pt_levels - 1], nr_bytes);
+		fprintf(stderr, "  buckets   : %lu (%lu bytes)\n", pt_stat.buckets, pt_stat.bucket_bytes);
+		nr_bytes += pt_stat.bucket_bytes;
+	} else {
+		/* Page directories shared since fork are counted by each sharer */
+		nr_tables[pt_levels - 1] -= pt_stat.shared;
 
-		fprintf(stderr, "%3d -> %-3d\n", t->vpn, t->pfn);
+		fprintf(stderr, "Page table (%u levels x %u bits)\n", pt_levels, pt_shift);
+		for (int i = 0; i < pt_levels; i++) {
+			fprintf(stderr, "  level %d   : %lu tables\n", i, nr_tables[i]);
+			nr_bytes += nr_tables[i] * pt_table_size(i);
+		}
+		if (pt_stat.shared) {
+			fprintf(stderr, "  shared    : %lu directory copies saved\n", pt_stat.shared);
+		}
+	}
+	fprintf(stderr, "  memory    : %lu bytes\n", nr_bytes);
+	fprintf(stderr, "  pool      : %lu in use (%lu bytes), %lu free\n",
+			pt_stat.tables, pt_stat.bytes, pt_stat.free);
+	fprintf(stderr, "  slabs     : %lu (%lu bytes)\n", pt_stat.slabs, pt_stat.slab_bytes);
+	fprintf(stderr, "  allocs    : %lu\n", pt_stat.allocs);
+}
+
+static void __show_stats(void)
+{
+	unsigned long nr_translations = tlbs[0]->stat.hits + tlbs[0]->stat.misses;
+	unsigned long nr_cycles = 0;
+
+	for (int i = 0; i < nr_tlb_levels; i++) {
+		struct tlb *tlb = tlbs[i];
+		unsigned long nr_lookups = tlb->stat.hits + tlb->stat.misses;
+
+		nr_cycles += nr_lookups * tlb->latency;
+
+		fprintf(stderr, "%s %ux%u %s (%s)\n", tlb->name,
+				tlb->nr_sets, tlb->nr_ways, tlb_policy_name(),
+				tlb->hash ? "hash" : tlb_matcher_name());
+		fprintf(stderr, "  lookups   : %lu\n", nr_lookups);
+		fprintf(stderr, "  hits      : %lu (%.2f%%)\n", tlb->stat.hits,
+				nr_lookups ? tlb->stat.hits * 100.0 / nr_lookups : 0.0);
+		fprintf(stderr, "  misses    : %lu\n", tlb->stat.misses);
+		fprintf(stderr, "  fills     : %lu\n", tlb->stat.fills);
+		fprintf(stderr, "  evictions : %lu\n", tlb->stat.evictions);
+		fprintf(stderr, "  flushes   : %lu\n", tlb->stat.flushes);
+		if (superpages) {
+			struct tlb_entry *t;
+			unsigned long reach = 0;
+
+			list_for_each_entry(t, &tlb->fifo, list) {
+				if (!tlb_entry_valid(tlb, t)) continue;
+				reach += t->huge ? NR_PTES_PER_PAGE : 1;
+			}
+			fprintf(stderr, "  huge hits : %lu\n", tlb->stat.huge_hits);
+			fprintf(stderr, "  reach     : %lu pages\n", reach);
+		}
+		if (prefetcher != PREFETCH_NONE && i == nr_tlb_levels - 1) {
+			fprintf(stderr, "  prefetch  : %lu (%s)\n", tlb->stat.prefetches,
+					prefetcher_names[prefetcher]);
+			fprintf(stderr, "    useful  : %lu (%.2f%%)\n", tlb->stat.prefetch_hits,
+					tlb->stat.prefetches ?
+					tlb->stat.prefetch_hits * 100.0 / tlb->stat.prefetches : 0.0);
+			fprintf(stderr, "    unused  : %lu evicted\n", tlb->stat.prefetch_unused);
+		}
+		fprintf(stderr, "  compares  : %.2f per lookup\n",
+				nr_lookups ? (double)tlb->stat.probes / nr_lookups : 0.0);
+	}
+	fprintf(stderr, "TLB lookup cost : %.2f cycles per translation\n",
+			nr_translations ? (double)nr_cycles / nr_translations : 0.0);
+
+	fprintf(stderr, "Page walk (page-walk cache %u entries)\n", nr_pwc_entries);
+	fprintf(stderr, "  walks     : %lu\n", walk_stat.walks);
+	fprintf(stderr, "  memrefs   : %.2f per walk\n",
+			walk_stat.walks ? (double)walk_stat.refs / walk_stat.walks : 0.0);
+	fprintf(stderr, "  pwc hits  : %lu (%.2f%%)\n", walk_stat.hits,
+			walk_stat.hits + walk_stat.misses ?
+			walk_stat.hits * 100.0 / (walk_stat.hits + walk_stat.misses) : 0.0);
+	if (pt_hashed()) {
+		for (int i = 1; i <= MAX_PT_LEVELS; i++) {
+			if (!walk_stat.touched[i]) continue;
+			fprintf(stderr, "  %d%s memref%s : %lu walks\n", i,
+					i == MAX_PT_LEVELS ? "+" : "", i > 1 ? "s" : " ",
+					walk_stat.touched[i]);
+		}
+	} else {
+		fprintf(stderr, "  saved     : %.2f memrefs per walk\n",
+				walk_stat.walks ?
+				(double)walk_stat.hits * (pt_levels - 1) / walk_stat.walks : 0.0);
+		for (int i = 1; i <= pt_levels; i++) {
+			if (!walk_stat.touched[i]) continue;
+			fprintf(stderr, "  %d level%s  : %lu walks\n", i, i > 1 ? "s" : " ",
+					walk_stat.touched[i]);
+		}
+	}
+
+	__show_pagetable_usage();
+
+	if (swap_enabled()) {
+		fprintf(stderr, "Swap\n");
+		fprintf(stderr, "  swap-ins  : %lu\n", swap_stat.swap_ins);
+		fprintf(stderr, "  swap-outs : %lu\n", swap_stat.swap_outs);
+		fprintf(stderr, "  slots     : %lu in use\n", swap_stat.slots);
+		fprintf(stderr, "  I/O time  : %.1f us\n", swap_stat.io_us);
+
+		fprintf(stderr, "Page replacement (%s)\n", reclaim_policy_name());
+		fprintf(stderr, "  accesses  : %lu\n", reclaim_stat.accesses);
+		fprintf(stderr, "  faults    : %lu (%.2f%%)\n", reclaim_stat.faults,
+				reclaim_stat.accesses ?
+				reclaim_stat.faults * 100.0 / reclaim_stat.accesses : 0.0);
+		fprintf(stderr, "  major     : %lu (%.2f%%)\n", swap_stat.swap_ins,
+				reclaim_stat.accesses ?
+				swap_stat.swap_ins * 100.0 / reclaim_stat.accesses : 0.0);
+		fprintf(stderr, "  evictions : %lu\n", reclaim_stat.evictions);
+		fprintf(stderr, "    clean   : %lu\n", reclaim_stat.clean_evictions);
+		fprintf(stderr, "  ghost hits: %lu\n", reclaim_stat.ghost_hits);
 	}
 }
 
@@ -299,9 +792,14 @@ static void __print_help(void)
 	printf("                 Fork @pid if there is no process with the pid\n");
 	printf("  show         : Show the page table of the current process\n");
 	printf("  pages        : Show the status for each page frame\n");
+	printf("  buddy        : Show the free blocks of each order\n");
+	printf("  scan         : Show the accessed and dirty bits of the pages and clear the accessed bits\n");
 	printf("  tlb          : Show TLB entries\n");
+	printf("  stats        : Show TLB and page walk statistics\n");
 	printf("\n");
 	printf("  alloc [vpn] r|w  : Allocate a page for the rw flag\n");
+	printf("  alloc [vpn] r|w [nr]\n");
+	printf("                   : Allocate @nr contiguous page frames to @nr pages from @vpn\n");
 	printf("  free [vpn]       : Deallocate the page at VPN @vpn\n");
 	printf("  access [vpn] r|w : Access VPN @vpn for read or write\n");
 	printf("  read [vpn]       : Equivalent to access @vpn r\n");
@@ -341,15 +839,21 @@ static void __do_simulation(FILE *input)
 				__show_pagetable();
 			} else if (strmatch(tokens[0], "pages")) {
 				__show_pageframes();
+			} else if (strmatch(tokens[0], "buddy")) {
+				__show_buddyinfo();
+			} else if (strmatch(tokens[0], "scan")) {
+				__scan_pagetable();
 			} else if (strmatch(tokens[0], "tlb")) {
 				__show_tlb();
+			} else if (strmatch(tokens[0], "stats")) {
+				__show_stats();
 			} else if (strmatch(tokens[0], "help") || strmatch(tokens[0], "?")) {
 				__print_help();
 			} else {
 				printf("Unknown command %s\n", tokens[0]);
 			}
 		} else if (nr_tokens == 2) {
-			unsigned int arg = strtoimax(tokens[1], NULL, 0);
+			unsigned long arg = strtoumax(tokens[1], NULL, 0);
 
 			if (strmatch(tokens[0], "switch") || strmatch(tokens[0], "s")) {
 				switch_process(arg);
@@ -363,7 +867,7 @@ static void __do_simulation(FILE *input)
 				printf("Unknown command %s\n", tokens[0]);
 			}
 		} else if (nr_tokens == 3) {
-			unsigned int vpn = strtoimax(tokens[1], NULL, 0);
+			unsigned long vpn = strtoumax(tokens[1], NULL, 0);
 			unsigned int rw = __make_rwflag(tokens[2]);
 
 			if (strmatch(tokens[0], "alloc") || strmatch(tokens[0], "a")) {
@@ -373,6 +877,16 @@ static void __do_simulation(FILE *input)
 			} else {
 				printf("Unknown command %s\n", tokens[0]);
 			}
+		} else if (nr_tokens == 4) {
+			unsigned long vpn = strtoumax(tokens[1], NULL, 0);
+			unsigned int rw = __make_rwflag(tokens[2]);
+			unsigned int nr_pages = strtoimax(tokens[3], NULL, 0);
+
+			if (strmatch(tokens[0], "alloc") || strmatch(tokens[0], "a")) {
+				if (!__alloc_pages(vpn, rw, nr_pages)) break;
+			} else {
+				printf("Unknown command %s\n", tokens[0]);
+			}
 		} else {
 			assert(!"Unknown command in trace");
 		}
@@ -381,19 +895,87 @@ static void __do_simulation(FILE *input)
 	}
 }
 
+/**
+ * Record the page references of the trace from @input without simulating it,
+ * and report the misses of the optimal replacement for the configured page
+ * frames and TLB
+ */
+static void __do_oracle(FILE *input)
+{
+	char command[MAX_COMMAND_LEN] = { 0 };
+	unsigned int pid = init.pid;
+
+	while (fgets(command, sizeof(command), input)) {
+		char *tokens[MAX_NR_TOKENS] = { NULL };
+		int nr_tokens = 0;
+		unsigned long vpn;
+
+		for (size_t i = 0; i < strlen(command); i++) {
+			command[i] = tolower(command[i]);
+		}
+
+		if (parse_command(command, &nr_tokens, tokens) < 0) continue;
+		if (nr_tokens < 2) {
+			if (nr_tokens && strmatch(tokens[0], "exit")) break;
+			continue;
+		}
+
+		vpn = strtoumax(tokens[1], NULL, 0);
+
+		if (strmatch(tokens[0], "switch") || strmatch(tokens[0], "s")) {
+			pid = vpn;
+		} else if (strmatch(tokens[0], "free") || strmatch(tokens[0], "f")) {
+			oracle_record(pid, vpn, ORACLE_FREE);
+		} else if (strmatch(tokens[0], "read") || strmatch(tokens[0], "r") ||
+				strmatch(tokens[0], "write") || strmatch(tokens[0], "w") ||
+				strmatch(tokens[0], "access")) {
+			oracle_record(pid, vpn, ORACLE_ACCESS);
+		} else if (strmatch(tokens[0], "alloc") || strmatch(tokens[0], "a")) {
+			unsigned int nr = nr_tokens == 4 ? strtoimax(tokens[3], NULL, 0) : 1;
+
+			for (unsigned int i = 0; i < nr; i++) {
+				oracle_record(pid, vpn + i, ORACLE_ALLOC);
+			}
+		}
+	}
+
+	oracle_report(nr_pageframes, tlb_sets, tlb_ways);
+}
+
 static void __print_usage(const char * name)
 {
-	printf("Usage: %s {-q} {-f [workload file]}\n", name);
+	printf("Usage: %s {-q} {-t} {-T [sets]x[ways]} {-L [sets]x[ways]} {-r [policy]} {-W [entries]} {-H} {-P [prefetcher]} {-m [memory size]} {-s [page size]} {-S [swap file]} {-R [policy]} {-a [policy]} {-l [levels]x[bits]} {-p [page table]} {-O} {-f [workload file]}\n", name);
 	printf("\n");
-	printf("  -q: Run quietly\n\n");
+	printf("  -q: Run quietly\n");
+	printf("  -t: Print out the TLB translation results\n");
+	printf("  -T: Use a set-associative TLB of [sets] x [ways] entries. Implies -t\n");
+	printf("      [sets] should be a power of two (default: 1x%d)\n", NR_TLB_ENTRIES);
+	printf("  -L: Put an L1 TLB of [sets] x [ways] entries in front of the TLB. Implies -t\n");
+	printf("  -r: TLB replacement policy; fifo (default), lru, clock, random, or lfu\n");
+	printf("  -W: Number of page-walk cache entries. 0 disables it (default: %d)\n", NR_PWC_ENTRIES);
+	printf("  -H: Cache superpages in TLB. Implies -t\n");
+	printf("  -P: TLB prefetcher; none (default), next, stride, or dir. Implies -t\n");
+	printf("  -m: Size of physical memory such as 512K or 16G (default: %d page frames)\n", NR_PAGEFRAMES);
+	printf("  -s: Page size (default: %d)\n", PAGE_SIZE);
+	printf("  -S: Swap pages out to [swap file] when the memory is full\n");
+	printf("  -R: Page replacement policy; clock (default), fifo, second, 2q, arc, or wsclock\n");
+	printf("  -a: When to set accessed bits; walk (default) or hit on TLB hits as well\n");
+	printf("  -l: Use a page table of [levels] levels of 2^[bits] entries (default: %dx%d)\n",
+			NR_PT_LEVELS, PTES_PER_PAGE_SHIFT);
+	printf("  -p: Page table organization; radix (default), hash, or inverted\n");
+	printf("  -O: Report the optimal (Belady) misses of the trace for the page frames\n");
+	printf("      and TLB configured with -m and -T instead of simulating it\n\n");
 }
 
 int main(int argc, char * argv[])
 {
 	int opt;
 	FILE *input = stdin;
+	unsigned long long memory_size = 0;
+	const char *swap_file = NULL;
+	bool oracle = false;
 
-	while ((opt = getopt(argc, argv, "qht")) != -1) {
+	while ((opt = getopt(argc, argv, "qhtT:L:r:W:HP:m:s:S:R:a:l:p:O")) != -1) {
 		switch (opt) {
 		case 'q':
 			verbose = false;
@@ -401,6 +983,101 @@ int main(int argc, char * argv[])
 		case 't':
 			print_tlb_result = true;
 			break;
+		case 'T':
+			if (sscanf(optarg, "%ux%u", &tlb_sets, &tlb_ways) != 2 ||
+					!tlb_sets || !tlb_ways || (tlb_sets & (tlb_sets - 1))) {
+				fprintf(stderr, "Invalid TLB geometry %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			print_tlb_result = true;
+			break;
+		case 'L':
+			if (sscanf(optarg, "%ux%u", &l1_tlb_sets, &l1_tlb_ways) != 2 ||
+					!l1_tlb_sets || !l1_tlb_ways || (l1_tlb_sets & (l1_tlb_sets - 1))) {
+				fprintf(stderr, "Invalid L1 TLB geometry %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			print_tlb_result = true;
+			break;
+		case 'r':
+			if (!set_tlb_policy(optarg)) {
+				fprintf(stderr, "Unknown TLB replacement policy %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'W':
+			pwc_entries = strtoimax(optarg, NULL, 0);
+			if (pwc_entries & (pwc_entries - 1)) {
+				fprintf(stderr, "Page-walk cache entries should be a power of two\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			superpages = true;
+			print_tlb_result = true;
+			break;
+		case 'P':
+			for (prefetcher = 0; prefetcher <= PREFETCH_DIR; prefetcher++) {
+				if (strcmp(optarg, prefetcher_names[prefetcher]) == 0) break;
+			}
+			if (prefetcher > PREFETCH_DIR) {
+				fprintf(stderr, "Unknown TLB prefetcher %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			print_tlb_result = true;
+			break;
+		case 'm':
+			if (!__parse_size(optarg, &memory_size) || !memory_size) {
+				fprintf(stderr, "Invalid memory size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's': {
+			unsigned long long size;
+
+			if (!__parse_size(optarg, &size) || !size || (size & (size - 1))) {
+				fprintf(stderr, "Page size should be a power of two\n");
+				return EXIT_FAILURE;
+			}
+			page_size = size;
+			break;
+		}
+		case 'S':
+			swap_file = optarg;
+			break;
+		case 'R':
+			if (!set_reclaim_policy(optarg)) {
+				fprintf(stderr, "Unknown page replacement policy %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			if (strcmp(optarg, "hit") == 0) {
+				accessed_on_hit = true;
+			} else if (strcmp(optarg, "walk") != 0) {
+				fprintf(stderr, "Unknown accessed bit policy %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l': {
+			unsigned int levels, shift;
+
+			if (sscanf(optarg, "%ux%u", &levels, &shift) != 2 ||
+					!init_pagetable(levels, shift)) {
+				fprintf(stderr, "Invalid page table geometry %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case 'p':
+			if (!set_pt_backend(optarg)) {
+				fprintf(stderr, "Unknown page table organization %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'O':
+			oracle = true;
+			break;
 		case 'h':
 		default:
 			__print_usage(argv[0]);
@@ -408,6 +1085,22 @@ int main(int argc, char * argv[])
 		}
 	}
 
+	if (memory_size) {
+		unsigned long long nr = memory_size / page_size;
+
+		/* PFN -1 stands for no page frame */
+		if (!nr || nr >= (unsigned int)-1) {
+			fprintf(stderr, "Cannot have %llu page frames\n", nr);
+			return EXIT_FAILURE;
+		}
+		nr_pageframes = nr;
+	}
+
+	if (swap_file && !init_swap(swap_file, page_size)) {
+		fprintf(stderr, "Cannot use %s for swap\n", swap_file);
+		return EXIT_FAILURE;
+	}
+
 	if (verbose && !argv[optind]) {
 		printf("***************************************************************************\n");
 		printf(" Welcome to\n\n");
@@ -441,7 +1134,11 @@ int main(int argc, char * argv[])
 		printf(">> ");
 	}
 
-	__do_simulation(input);
+	if (oracle) {
+		__do_oracle(input);
+	} else {
+		__do_simulation(input);
+	}
 
 	if (input != stdin) fclose(input);
 
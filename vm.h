@@ -17,32 +17,145 @@
 
 #include "types.h"
 
-/* The number of physical page frames of the system */
+/**
+ * The default number of physical page frames of the system and the default
+ * page size. Both can be changed at startup with -m and -s
+ */
 #define NR_PAGEFRAMES	128
+#define PAGE_SIZE	4096
 
-/* The number of PTEs in a page */
+/**
+ * The default geometry of the page table; NR_PT_LEVELS levels of
+ * 2^PTES_PER_PAGE_SHIFT entries each. -l changes them at startup, and
+ * @pt_levels and @pt_shift hold the ones in effect.
+ */
+#define NR_PT_LEVELS		2
 #define PTES_PER_PAGE_SHIFT	4
-#define NR_PTES_PER_PAGE    (1 << PTES_PER_PAGE_SHIFT)
+
+/* Limits of the page table geometry. VPNs are up to VPN_MAX_BITS wide */
+#define MAX_PT_LEVELS		6
+#define VPN_MAX_BITS		56
+
+extern unsigned int pt_levels;
+extern unsigned int pt_shift;
+
+/* The number of PTEs in a page, and the number of VPNs of a process */
+#define NR_PTES_PER_PAGE	(1UL << pt_shift)
+#define NR_VPNS			(1UL << (pt_levels * pt_shift))
 
 #define RW_READ  0x01
 #define RW_WRITE 0x02
 
 /**
- * 2-level page table abstraction
+ * Hierarchical page table abstraction of @pt_levels levels. A PTE is packed
+ * into a single 64-bit word; the flags are in the low bits and the PFN, or
+ * the swap slot of a swapped-out page, is in the upper 32 bits. Access the
+ * word through the helpers below.
  */
 struct pte {
-	bool valid;
-	bool writable;
-	unsigned int pfn;
-	unsigned int private;	/* May use to backup something ;-) */
+	unsigned long long val;
 };
 
+#define PTE_VALID	(1ULL << 0)
+#define PTE_WRITABLE	(1ULL << 1)
+#define PTE_COW		(1ULL << 2)	/* Writable page shared since fork */
+#define PTE_ACCESSED	(1ULL << 3)	/* Set by MMU when the page is walked to */
+#define PTE_DIRTY	(1ULL << 4)	/* Set by MMU when the page is written */
+#define PTE_SWAPPED	(1ULL << 5)	/* Not valid but swapped out to the slot in PFN */
+
+#define PTE_PFN_SHIFT	32
+#define PTE_FLAGS_MASK	((1ULL << PTE_PFN_SHIFT) - 1)
+
+static inline bool pte_valid(const struct pte *pte)
+{
+	return !!(pte->val & PTE_VALID);
+}
+
+static inline bool pte_writable(const struct pte *pte)
+{
+	return !!(pte->val & PTE_WRITABLE);
+}
+
+static inline bool pte_cow(const struct pte *pte)
+{
+	return !!(pte->val & PTE_COW);
+}
+
+static inline bool pte_accessed(const struct pte *pte)
+{
+	return !!(pte->val & PTE_ACCESSED);
+}
+
+static inline bool pte_dirty(const struct pte *pte)
+{
+	return !!(pte->val & PTE_DIRTY);
+}
+
+static inline bool pte_swapped(const struct pte *pte)
+{
+	return !!(pte->val & PTE_SWAPPED);
+}
+
+/* Neither mapped nor swapped out */
+static inline bool pte_none(const struct pte *pte)
+{
+	return !(pte->val & (PTE_VALID | PTE_SWAPPED));
+}
+
+static inline unsigned int pte_pfn(const struct pte *pte)
+{
+	return pte->val >> PTE_PFN_SHIFT;
+}
+
+static inline void pte_set(struct pte *pte, unsigned long long flags)
+{
+	pte->val |= flags;
+}
+
+static inline void pte_clear(struct pte *pte, unsigned long long flags)
+{
+	pte->val &= ~flags;
+}
+
+/* Point @pte to @pfn, keeping its flags */
+static inline void pte_set_pfn(struct pte *pte, unsigned int pfn)
+{
+	pte->val = (pte->val & PTE_FLAGS_MASK) |
+		((unsigned long long)pfn << PTE_PFN_SHIFT);
+}
+
+/* Overwrite @pte with @pfn and @flags */
+static inline void set_pte(struct pte *pte, unsigned int pfn, unsigned long long flags)
+{
+	pte->val = ((unsigned long long)pfn << PTE_PFN_SHIFT) | flags;
+}
+
+/**
+ * Table of the last level, holding NR_PTES_PER_PAGE PTEs
+ */
 struct pte_directory {
-	struct pte ptes[NR_PTES_PER_PAGE];
+	bool huge;	/* PTEs map an aligned superpage and can share a TLB entry */
+	unsigned int refcount;	/* Page tables holding it; shared since fork if > 1 */
+	struct pte ptes[];
 };
 
+/**
+ * @outer_ptes is the table of the top level. Each table of the upper levels
+ * holds NR_PTES_PER_PAGE pointers to the tables of the next level, which
+ * are page directories at the last level. Tables are allocated on demand.
+ *
+ * With the hashed page tables, the page directories are looked up in
+ * @buckets, or in the inverted page table of the system by @id, and are
+ * chained in @pds. See pagetable.h.
+ */
 struct pagetable {
-	struct pte_directory *outer_ptes[NR_PTES_PER_PAGE];
+	void **outer_ptes;
+
+	unsigned int id;		/* Address space in the inverted page table */
+	struct hlist_head *buckets;	/* 2^@bucket_shift buckets */
+	unsigned int bucket_shift;
+	unsigned long nr_pds;
+	struct list_head pds;
 };
 
 
@@ -52,6 +165,9 @@ struct pagetable {
 struct process {
 	unsigned int pid;
 
+	unsigned int asid;		/* Address space ID tagging the TLB entries */
+	unsigned long asid_gen;	/* ASID generation that @asid is valid for */
+
 	struct pagetable pagetable;
 
 	struct list_head list;  /* List head to chain processes on the system */
@@ -59,10 +175,25 @@ struct process {
 
 
 struct tlb_entry {
-	bool valid;
-	unsigned int vpn;
 	unsigned int pfn;
+	bool writable;		/* Writes can be served from this entry */
+	bool cow;		/* Write-protected for copy-on-write */
+	bool huge;		/* Maps a whole page directory from @pfn */
+	bool prefetched;	/* Filled by the prefetcher and not hit yet */
+
+	bool referenced;	/* Reference bit for CLOCK replacement */
+	unsigned int freq;	/* Access count for LFU replacement */
+
+	struct hlist_node hnode;	/* Chain in the hash index of TLB */
+	struct list_head list;		/* In @tlb_fifo while valid */
+	struct list_head set_list;	/* In the replacement or free list of its set */
+	struct list_head asid_list;	/* In the list of its ASID while valid */
 };
 
+/* The default number of TLB entries */
 #define NR_TLB_ENTRIES	(1 << (PTES_PER_PAGE_SHIFT * 2))
+
+/* The number of address space IDs the TLB can tell apart */
+#define ASID_BITS	8
+#define NR_ASIDS	(1 << ASID_BITS)
 #endif